@@ -0,0 +1,119 @@
+#ifndef EXPRESSION_TEMPLATES_H
+#define EXPRESSION_TEMPLATES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Expression templates mirroring the evaluator's trees: literals, variables,
+// unary minus and binary add/sub/mul, built from C++ operators at compile time
+// and evaluated with the same modulo 2^64 arithmetic as
+// evaluateConstantExpressionTree. Nodes hold their children by value, so an
+// expression is a plain value type with no allocation and no dispatch.
+
+struct AddOperation {
+    static constexpr std::uint64_t apply(std::uint64_t a, std::uint64_t b) { return a + b; }
+};
+
+struct SubtractOperation {
+    static constexpr std::uint64_t apply(std::uint64_t a, std::uint64_t b) { return a - b; }
+};
+
+struct MultiplyOperation {
+    static constexpr std::uint64_t apply(std::uint64_t a, std::uint64_t b) { return a * b; }
+};
+
+struct NegateOperation {
+    static constexpr std::uint64_t apply(std::uint64_t a) { return -a; }
+};
+
+struct ExpressionTemplate {};
+
+struct LiteralExpression : ExpressionTemplate {
+    std::uint64_t value;
+
+    constexpr explicit LiteralExpression(std::uint64_t value) : value(value) {}
+    constexpr std::uint64_t evaluate(const std::uint64_t * = nullptr) const { return value; }
+};
+
+// Reads slot index of the bindings array, like VariableTree.
+struct VariableExpression : ExpressionTemplate {
+    size_t index;
+
+    constexpr explicit VariableExpression(size_t index) : index(index) {}
+    constexpr std::uint64_t evaluate(const std::uint64_t *variables = nullptr) const { return variables ? variables[index] : 0; }
+};
+
+template <typename Operation, typename Child>
+struct UnaryExpression : ExpressionTemplate {
+    Child child;
+
+    constexpr explicit UnaryExpression(const Child& child) : child(child) {}
+    constexpr std::uint64_t evaluate(const std::uint64_t *variables = nullptr) const {
+        return Operation::apply(child.evaluate(variables));
+    }
+};
+
+template <typename Operation, typename Left, typename Right>
+struct BinaryExpression : ExpressionTemplate {
+    Left left;
+    Right right;
+
+    constexpr BinaryExpression(const Left& left, const Right& right) : left(left), right(right) {}
+    constexpr std::uint64_t evaluate(const std::uint64_t *variables = nullptr) const {
+        return Operation::apply(left.evaluate(variables), right.evaluate(variables));
+    }
+};
+
+template <typename T>
+constexpr bool isExpressionTemplate = std::is_base_of<ExpressionTemplate, T>::value;
+
+template <typename T>
+constexpr bool isExpressionOperand = isExpressionTemplate<T> || std::is_integral<T>::value;
+
+// Integer operands become literals, converted to uint64 the way the evaluator
+// would see them.
+template <typename T>
+constexpr auto toExpressionTemplate(const T& value) {
+    if constexpr (isExpressionTemplate<T>)
+        return value;
+    else
+        return LiteralExpression(static_cast<std::uint64_t>(value));
+}
+
+template <typename Operation, typename Left, typename Right>
+constexpr auto makeBinaryExpression(const Left& left, const Right& right) {
+    auto a = toExpressionTemplate(left);
+    auto b = toExpressionTemplate(right);
+    return BinaryExpression<Operation, decltype(a), decltype(b)>(a, b);
+}
+
+constexpr LiteralExpression literal(std::uint64_t value) {
+    return LiteralExpression(value);
+}
+
+constexpr VariableExpression variable(size_t index) {
+    return VariableExpression(index);
+}
+
+template <typename Left, typename Right, typename = std::enable_if_t<(isExpressionTemplate<Left> || isExpressionTemplate<Right>) && isExpressionOperand<Left> && isExpressionOperand<Right>>>
+constexpr auto operator+(const Left& left, const Right& right) {
+    return makeBinaryExpression<AddOperation>(left, right);
+}
+
+template <typename Left, typename Right, typename = std::enable_if_t<(isExpressionTemplate<Left> || isExpressionTemplate<Right>) && isExpressionOperand<Left> && isExpressionOperand<Right>>>
+constexpr auto operator-(const Left& left, const Right& right) {
+    return makeBinaryExpression<SubtractOperation>(left, right);
+}
+
+template <typename Left, typename Right, typename = std::enable_if_t<(isExpressionTemplate<Left> || isExpressionTemplate<Right>) && isExpressionOperand<Left> && isExpressionOperand<Right>>>
+constexpr auto operator*(const Left& left, const Right& right) {
+    return makeBinaryExpression<MultiplyOperation>(left, right);
+}
+
+template <typename Child, typename = std::enable_if_t<isExpressionTemplate<Child>>>
+constexpr auto operator-(const Child& child) {
+    return UnaryExpression<NegateOperation, Child>(child);
+}
+
+#endif
@@ -1,10 +1,38 @@
 #include <cstdio>
 #include <cctype>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+#include "expression_templates.h"
 
 enum TokenType {
     TOKEN_TYPE_NULL,
     TOKEN_TYPE_INTEGER,
+    TOKEN_TYPE_IDENTIFIER,
     TOKEN_TYPE_ADD,
     TOKEN_TYPE_MINUS,
     TOKEN_TYPE_MUL,
@@ -12,35 +40,211 @@ enum TokenType {
     TOKEN_TYPE_RPAREN,
 };
 
+// A token is a slice of the scanner's buffer, use Scanner::getTokenName() for its text.
 struct Token {
-    std::string name;
+    size_t offset = 0;
+    size_t length = 0;
+    std::uint64_t value = 0;
     TokenType type;
 };
 
 typedef int Character;
 
-static bool beginsWithName(Character c) {
+static constexpr bool beginsWithName(Character c) {
     return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
 }
 
-static bool beginsWithDigit(Character c) {
+static constexpr bool beginsWithDigit(Character c) {
     return c >= '0' && c <= '9';
 }
 
-static bool isIdentifier(Character c) {
+static constexpr bool isIdentifier(Character c) {
     return beginsWithName(c) || beginsWithDigit(c);
 }
 
+// Same set as std::isspace in the C locale.
+static constexpr bool isWhitespace(Character c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+typedef size_t (*CharacterRunCounter)(const char *p, size_t n);
+
+static size_t countDigitsScalar(const char *p, size_t n) {
+    size_t i = 0;
+    while (i < n && beginsWithDigit(p[i]))
+        i++;
+    return i;
+}
+
+static size_t countWhitespaceScalar(const char *p, size_t n) {
+    size_t i = 0;
+    while (i < n && isWhitespace(p[i]))
+        i++;
+    return i;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// Vector versions classify a whole register of characters per step: a byte is a
+// digit when c - '0' <= 9 unsigned and whitespace when c == ' ' or c - '\t' <= 4.
+// The first mismatch is the lowest clear bit of the mask, the tail shorter than
+// one register is left to the scalar loop.
+static size_t countDigitsSse2(const char *p, size_t n) {
+    const __m128i zero = _mm_set1_epi8('0'), nine = _mm_set1_epi8(9);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i d = _mm_sub_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i)), zero);
+        unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d, nine), d)) & 0xFFFF;
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + countDigitsScalar(p + i, n - i);
+}
+
+static size_t countWhitespaceSse2(const char *p, size_t n) {
+    const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        __m128i d = _mm_sub_epi8(c, tab);
+        __m128i matches = _mm_or_si128(_mm_cmpeq_epi8(c, space), _mm_cmpeq_epi8(_mm_min_epu8(d, four), d));
+        unsigned mask = ~_mm_movemask_epi8(matches) & 0xFFFF;
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + countWhitespaceScalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t countDigitsAvx2(const char *p, size_t n) {
+    const __m256i zero = _mm256_set1_epi8('0'), nine = _mm256_set1_epi8(9);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i d = _mm256_sub_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i)), zero);
+        unsigned mask = ~(unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(d, nine), d));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + countDigitsScalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t countWhitespaceAvx2(const char *p, size_t n) {
+    const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), four = _mm256_set1_epi8(4);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        __m256i d = _mm256_sub_epi8(c, tab);
+        __m256i matches = _mm256_or_si256(_mm256_cmpeq_epi8(c, space), _mm256_cmpeq_epi8(_mm256_min_epu8(d, four), d));
+        unsigned mask = ~(unsigned) _mm256_movemask_epi8(matches);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + countWhitespaceScalar(p + i, n - i);
+}
+
+__attribute__((target("avx512bw")))
+static size_t countDigitsAvx512(const char *p, size_t n) {
+    const __m512i zero = _mm512_set1_epi8('0'), nine = _mm512_set1_epi8(9);
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m512i d = _mm512_sub_epi8(_mm512_loadu_si512(p + i), zero);
+        std::uint64_t mask = ~(std::uint64_t) _mm512_cmple_epu8_mask(d, nine);
+        if (mask)
+            return i + __builtin_ctzll(mask);
+    }
+    return i + countDigitsScalar(p + i, n - i);
+}
+
+__attribute__((target("avx512bw")))
+static size_t countWhitespaceAvx512(const char *p, size_t n) {
+    const __m512i space = _mm512_set1_epi8(' '), tab = _mm512_set1_epi8('\t'), four = _mm512_set1_epi8(4);
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m512i c = _mm512_loadu_si512(p + i);
+        __mmask64 matches = _mm512_cmpeq_epi8_mask(c, space) | _mm512_cmple_epu8_mask(_mm512_sub_epi8(c, tab), four);
+        std::uint64_t mask = ~(std::uint64_t) matches;
+        if (mask)
+            return i + __builtin_ctzll(mask);
+    }
+    return i + countWhitespaceScalar(p + i, n - i);
+}
+#endif
+
+struct CharacterRunCounters {
+    CharacterRunCounter countDigits;
+    CharacterRunCounter countWhitespace;
+};
+
+static CharacterRunCounters selectCharacterRunCounters() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+        return { countDigitsAvx512, countWhitespaceAvx512 };
+    if (__builtin_cpu_supports("avx2"))
+        return { countDigitsAvx2, countWhitespaceAvx2 };
+    return { countDigitsSse2, countWhitespaceSse2 };
+#else
+    return { countDigitsScalar, countWhitespaceScalar };
+#endif
+}
+
+static const CharacterRunCounters characterRunCounters = selectCharacterRunCounters();
+
+// Most runs are a single space or a few digits, too short to pay for an indirect
+// call, so the first bytes are classified inline and the vector counter only
+// takes over once a run reaches this length.
+static constexpr size_t vectorRunThreshold = 16;
+
+template <bool inRun(Character)>
+static inline size_t countCharacterRun(const char *p, size_t n, CharacterRunCounter countLongRun) {
+    size_t limit = std::min(n, vectorRunThreshold);
+    size_t i = 0;
+    while (i < limit && inRun(p[i]))
+        i++;
+    if (i < vectorRunThreshold)
+        return i;
+    return i + countLongRun(p + i, n - i);
+}
+
+// Converts n decimal digits, eight at a time with SWAR multiplies where the byte
+// order allows. Overlong runs wrap modulo 2^64 exactly like a digit-by-digit loop.
+static std::uint64_t parseDigits(const char *p, size_t n) {
+    std::uint64_t value = 0;
+    size_t i = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; i + 8 <= n; i += 8) {
+        std::uint64_t chunk;
+        std::memcpy(&chunk, p + i, 8);
+        chunk = (chunk & 0x0F0F0F0F0F0F0F0F) * 2561 >> 8;
+        chunk = (chunk & 0x00FF00FF00FF00FF) * 6553601 >> 16;
+        chunk = (chunk & 0x0000FFFF0000FFFF) * 42949672960001 >> 32;
+        value = value * 100000000 + chunk;
+    }
+#endif
+    for (; i < n; i++)
+        value = value * 10 + (p[i] - '0');
+    return value;
+}
+
 struct Scanner {
 private:
-    std::string buffer;
+    std::string ownedBuffer;
+    std::string_view buffer;
     size_t currentCharacterIndex;
     size_t nextCharacterIndex;
+    Token lookahead;
+    bool hasLookahead = false;
+    FILE *diagnostics = stdout;
+
+    Token scanToken();
 public:
     Character getCharacter();
     void setBuffer(const std::string& buf);
-    void incrementPosition(int amount = 1);
-    Token peekToken();
+    void setBufferView(std::string_view buf);
+    void setDiagnostics(FILE *stream) { diagnostics = stream; }
+    std::string_view getTokenName(const Token& t) const;
+    void incrementPosition(size_t amount = 1);
+    const Token& peekToken();
     void nextToken();
 };
 
@@ -50,54 +254,73 @@ Character Scanner::getCharacter() {
     return buffer[currentCharacterIndex];
 }
 
-void Scanner::incrementPosition(int amount) {
+void Scanner::incrementPosition(size_t amount) {
     currentCharacterIndex += amount;
 }
 
 void Scanner::setBuffer(const std::string& buf) {
+    ownedBuffer = buf;
+    setBufferView(ownedBuffer);
+}
+
+// The caller keeps buf alive for as long as the scanner and its tokens are in use.
+void Scanner::setBufferView(std::string_view buf) {
     currentCharacterIndex = 0;
+    hasLookahead = false;
     buffer = buf;
 }
 
-Token Scanner::peekToken() {
+std::string_view Scanner::getTokenName(const Token& t) const {
+    return buffer.substr(t.offset, t.length);
+}
+
+Token Scanner::scanToken() {
     Token t;
     Character c;
 
     size_t previousCharacterIndex = currentCharacterIndex;
     c = getCharacter();
-    if (c == 0) {
-        t.type = TOKEN_TYPE_NULL;
-        return t;
+    if (isWhitespace(c)) {
+        incrementPosition(countCharacterRun<isWhitespace>(buffer.data() + currentCharacterIndex, buffer.length() - currentCharacterIndex, characterRunCounters.countWhitespace));
+        c = getCharacter();
     }
 
-    if (!std::isprint(c)) {
-        printf("Bad lexical analysis stream (no such printable character)\n");
+    // Whitespace is skipped first, so the end of input and unprintable bytes are
+    // reported at the character after it, which nextToken() never consumes.
+    if (c == 0 || !std::isprint(c)) {
+        if (c != 0)
+            fprintf(diagnostics, "Bad lexical analysis stream (no such printable character)\n");
         t.type = TOKEN_TYPE_NULL;
+        nextCharacterIndex = currentCharacterIndex;
+        currentCharacterIndex = previousCharacterIndex;
         return t;
     }
 
-    while (std::isspace(c)) {
-        incrementPosition();
-        c = getCharacter();
-    }
-
+    t.offset = currentCharacterIndex;
     if (beginsWithDigit(c)) {
+        const char *digits = buffer.data() + currentCharacterIndex;
         t.type = TOKEN_TYPE_INTEGER;
-        while (beginsWithDigit(c)) {
-            t.name += c;
-            incrementPosition();
-            c = getCharacter();
-        }
+        t.length = countCharacterRun<beginsWithDigit>(digits, buffer.length() - currentCharacterIndex, characterRunCounters.countDigits);
+        t.value = parseDigits(digits, t.length);
+        incrementPosition(t.length);
+        c = getCharacter();
 
         if (isIdentifier(c) || c == '.') {
-            printf("skipping trailing characters for integer\n");
+            fprintf(diagnostics, "skipping trailing characters for integer\n");
             while (isIdentifier(c) || c == '.') {
                 incrementPosition();
                 c = getCharacter();
             }
         }
+    } else if (beginsWithName(c)) {
+        t.type = TOKEN_TYPE_IDENTIFIER;
+        while (isIdentifier(c)) {
+            incrementPosition();
+            c = getCharacter();
+        }
+        t.length = currentCharacterIndex - t.offset;
     } else {
-        t.name = c;
+        t.length = 1;
         switch (c) {
         case '+':
             t.type = TOKEN_TYPE_ADD;
@@ -120,7 +343,7 @@ Token Scanner::peekToken() {
             incrementPosition();
             break;
         default:
-            printf("Unexpected lexical analysis character %c\n", c);
+            fprintf(diagnostics, "Unexpected lexical analysis character %c\n", c);
             t.type = TOKEN_TYPE_NULL;
         }
     }
@@ -130,8 +353,21 @@ Token Scanner::peekToken() {
     return t;
 }
 
+// The token at the current position is lexed once and cached until nextToken()
+// consumes it, so repeated peeks from the parser cost nothing.
+const Token& Scanner::peekToken() {
+    if (!hasLookahead) {
+        lookahead = scanToken();
+        hasLookahead = true;
+    }
+    return lookahead;
+}
+
 void Scanner::nextToken() {
+    if (!hasLookahead)
+        peekToken();
     currentCharacterIndex = nextCharacterIndex;
+    hasLookahead = false;
 }
 
 enum TreeType {
@@ -139,6 +375,7 @@ enum TreeType {
     TREE_TYPE_LITERAL,
     TREE_TYPE_UNARY_EXPRESSION,
     TREE_TYPE_BINARY_EXPRESSION,
+    TREE_TYPE_VARIABLE,
 };
 
 struct Tree {
@@ -146,7 +383,7 @@ struct Tree {
 };
 
 struct LiteralTree : Tree {
-    Token token;
+    std::uint64_t value;
 };
 
 struct UnaryExpressionTree : Tree {
@@ -160,23 +397,90 @@ struct BinaryExpressionTree : Tree {
     Tree *right;
 };
 
-LiteralTree *createLiteralTree(const Token& token) {
-    LiteralTree *tree = new LiteralTree;
+// Refers to a variable by its slot in the parser's VariableTable, evaluation
+// reads the value from the same slot of the bindings array.
+struct VariableTree : Tree {
+    size_t index;
+};
+
+// Bump allocator owning every node of a parse. Nodes are never freed one by one,
+// reset() rewinds to the first block and keeps the memory around for the next parse.
+struct TreeArena {
+private:
+    struct Block {
+        std::unique_ptr<char[]> memory;
+        size_t size;
+    };
+
+    static constexpr size_t defaultBlockSize = 64 * 1024;
+
+    std::vector<Block> blocks;
+    size_t currentBlock = 0;
+    size_t currentOffset = 0;
+public:
+    void *allocate(size_t size, size_t alignment);
+    void reset();
+
+    template <typename T>
+    T *create() {
+        static_assert(std::is_trivially_destructible<T>::value, "arena nodes are never destroyed");
+        return new (allocate(sizeof(T), alignof(T))) T;
+    }
+};
+
+void *TreeArena::allocate(size_t size, size_t alignment) {
+    while (currentBlock < blocks.size()) {
+        Block& block = blocks[currentBlock];
+        uintptr_t base = reinterpret_cast<uintptr_t>(block.memory.get());
+        size_t offset = ((base + currentOffset + alignment - 1) & ~(alignment - 1)) - base;
+        if (offset + size <= block.size) {
+            currentOffset = offset + size;
+            return block.memory.get() + offset;
+        }
+        currentBlock++;
+        currentOffset = 0;
+    }
+
+    size_t blockSize = size + alignment > defaultBlockSize ? size + alignment : defaultBlockSize;
+    blocks.push_back({ std::unique_ptr<char[]>(new char[blockSize]), blockSize });
+    currentBlock = blocks.size() - 1;
+    currentOffset = 0;
+    return allocate(size, alignment);
+}
+
+void TreeArena::reset() {
+    currentBlock = 0;
+    currentOffset = 0;
+}
+
+LiteralTree *createLiteralTree(TreeArena& arena, std::uint64_t value) {
+    LiteralTree *tree = arena.create<LiteralTree>();
     tree->treeType = TREE_TYPE_LITERAL;
-    tree->token = token;
+    tree->value = value;
+    return tree;
+}
+
+LiteralTree *createLiteralTree(TreeArena& arena, const Token& token) {
+    return createLiteralTree(arena, token.value);
+}
+
+VariableTree *createVariableTree(TreeArena& arena, size_t index) {
+    VariableTree *tree = arena.create<VariableTree>();
+    tree->treeType = TREE_TYPE_VARIABLE;
+    tree->index = index;
     return tree;
 }
 
-UnaryExpressionTree *createUnaryExpressionTree(TokenType operatorType, Tree *child) {
-    UnaryExpressionTree *expr = new UnaryExpressionTree;
+UnaryExpressionTree *createUnaryExpressionTree(TreeArena& arena, TokenType operatorType, Tree *child) {
+    UnaryExpressionTree *expr = arena.create<UnaryExpressionTree>();
     expr->treeType = TREE_TYPE_UNARY_EXPRESSION;
     expr->operatorType = operatorType;
     expr->child = child;
     return expr;
 }
 
-BinaryExpressionTree *createBinaryExpressionTree(int operatorType, Tree *left, Tree *right) {
-    BinaryExpressionTree *expr = new BinaryExpressionTree;
+BinaryExpressionTree *createBinaryExpressionTree(TreeArena& arena, int operatorType, Tree *left, Tree *right) {
+    BinaryExpressionTree *expr = arena.create<BinaryExpressionTree>();
     expr->treeType = TREE_TYPE_BINARY_EXPRESSION;
     expr->operatorType = operatorType;
     expr->left = left;
@@ -184,8 +488,6 @@ BinaryExpressionTree *createBinaryExpressionTree(int operatorType, Tree *left, T
     return expr;
 }
 
-Scanner s;
-
 bool matchToken(const Token& t, TokenType type) {
     return t.type == type;
 }
@@ -198,94 +500,402 @@ static bool matchFactor(const Token& t) {
     return t.type == TOKEN_TYPE_MUL;
 }
 
-Tree *parseExpression();
+static std::uint64_t foldBinaryOperator(int operatorType, std::uint64_t a, std::uint64_t b) {
+    switch (operatorType) {
+    case TOKEN_TYPE_ADD:
+        return a + b;
+    case TOKEN_TYPE_MINUS:
+        return a - b;
+    case TOKEN_TYPE_MUL:
+        return a * b;
+    default:
+        return 0;
+    }
+}
 
-void destroyExpressionTreeWithChildren(Tree *expr) {
-    if (!expr)
-        return;
+// Maps variable names to binding slots in order of first appearance. Small
+// tables are scanned; past linearScanLimit names lookups go through a hash index
+// whose keys view the stored names. A deque never moves its elements, so those
+// views stay valid as names are added, and copies rebuild the index over their
+// own names.
+struct VariableTable {
+private:
+    static constexpr size_t linearScanLimit = 16;
 
-    switch (expr->treeType) {
-    case TREE_TYPE_BINARY_EXPRESSION:
-        destroyExpressionTreeWithChildren(static_cast<BinaryExpressionTree *>(expr)->left);
-        destroyExpressionTreeWithChildren(static_cast<BinaryExpressionTree *>(expr)->right);
-        reinterpret_cast<BinaryExpressionTree *>(expr)->left = nullptr;
-        reinterpret_cast<BinaryExpressionTree *>(expr)->right = nullptr;
-        delete static_cast<BinaryExpressionTree *>(expr);
-        break;
-    case TREE_TYPE_LITERAL:
-        delete static_cast<LiteralTree *>(expr);
-        break;
-    case TREE_TYPE_UNARY_EXPRESSION:
-        destroyExpressionTreeWithChildren(static_cast<UnaryExpressionTree *>(expr)->child);
-        reinterpret_cast<UnaryExpressionTree *>(expr)->child = nullptr;
-        delete static_cast<UnaryExpressionTree *>(expr);
-        break;
-    default:
-        printf("What tree is this?\n");
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, size_t> slots;
+
+    void rebuildSlots();
+public:
+    VariableTable() = default;
+    VariableTable(const VariableTable& other) : names(other.names) { rebuildSlots(); }
+    VariableTable(VariableTable&&) = default;
+    VariableTable& operator=(const VariableTable& other);
+    VariableTable& operator=(VariableTable&&) = default;
+
+    size_t getIndex(std::string_view name);
+    bool findIndex(std::string_view name, size_t& index) const;
+    const std::string& getName(size_t index) const { return names[index]; }
+    size_t size() const { return names.size(); }
+    void clear();
+};
+
+void VariableTable::rebuildSlots() {
+    slots.clear();
+    if (names.size() <= linearScanLimit)
         return;
+    for (size_t i = 0; i < names.size(); i++)
+        slots.emplace(names[i], i);
+}
+
+VariableTable& VariableTable::operator=(const VariableTable& other) {
+    if (this != &other) {
+        names = other.names;
+        rebuildSlots();
+    }
+    return *this;
+}
+
+size_t VariableTable::getIndex(std::string_view name) {
+    size_t index;
+    if (findIndex(name, index))
+        return index;
+    names.emplace_back(name);
+    if (names.size() == linearScanLimit + 1)
+        rebuildSlots();
+    else if (names.size() > linearScanLimit)
+        slots.emplace(names.back(), names.size() - 1);
+    return names.size() - 1;
+}
+
+bool VariableTable::findIndex(std::string_view name, size_t& index) const {
+    if (names.size() <= linearScanLimit) {
+        for (size_t i = 0; i < names.size(); i++) {
+            if (names[i] == name) {
+                index = i;
+                return true;
+            }
+        }
+        return false;
     }
+
+    auto it = slots.find(name);
+    if (it == slots.end())
+        return false;
+    index = it->second;
+    return true;
+}
+
+void VariableTable::clear() {
+    if (names.empty())
+        return;
+    names.clear();
+    if (!slots.empty())
+        slots.clear();
+}
+
+// One parser per thread: each owns its scanner and the arena holding the trees it
+// returns, which stay valid until the next reset().
+struct Parser {
+private:
+    Scanner s;
+    TreeArena arena;
+    VariableTable variables;
+    std::vector<Tree *> operandStack;
+    std::vector<std::uint64_t> valueStack;
+    std::vector<TokenType> operatorStack;
+    FILE *diagnostics = stdout;
+
+    Tree *parsePrimary();
+    Tree *parseOperand(const Token& t);
+    Tree *parseBinaryExpression(int minimumPrecedence);
+    std::uint64_t evaluatePrimary();
+    std::uint64_t evaluateBinaryExpression(int minimumPrecedence);
+    void reduceOperator();
+    void reduceValueOperator();
+public:
+    void setBuffer(const std::string& buf);
+    void setBufferView(std::string_view buf);
+    void setDiagnostics(FILE *stream);
+    Tree *parseExpression();
+    Tree *parseExpressionIterative();
+    std::uint64_t evaluateExpression();
+    std::uint64_t evaluateExpressionIterative();
+    TreeArena& getArena() { return arena; }
+    const VariableTable& getVariables() const { return variables; }
+    void reset();
+};
+
+void Parser::setBuffer(const std::string& buf) {
+    s.setBuffer(buf);
+}
+
+void Parser::setBufferView(std::string_view buf) {
+    s.setBufferView(buf);
 }
 
-Tree *parsePrimary() {
+// Syntax errors go to stdout unless redirected, e.g. to keep them out of a
+// result stream.
+void Parser::setDiagnostics(FILE *stream) {
+    diagnostics = stream;
+    s.setDiagnostics(stream);
+}
+
+void Parser::reset() {
+    arena.reset();
+    variables.clear();
+}
+
+Tree *Parser::parseOperand(const Token& t) {
+    if (matchToken(t, TOKEN_TYPE_INTEGER))
+        return createLiteralTree(arena, t);
+    return createVariableTree(arena, variables.getIndex(s.getTokenName(t)));
+}
+
+Tree *Parser::parsePrimary() {
     Token t = s.peekToken();
     Tree *tree;
 
-    if (matchToken(t, TOKEN_TYPE_INTEGER)) {
+    if (matchToken(t, TOKEN_TYPE_INTEGER) || matchToken(t, TOKEN_TYPE_IDENTIFIER)) {
+        tree = parseOperand(t);
         s.nextToken();
-        tree = createLiteralTree(t);
         return tree;
     } else if (matchToken(t, TOKEN_TYPE_LPAREN)) {
         s.nextToken();
         tree = parseExpression();
         if (t = s.peekToken(); t.type != TOKEN_TYPE_RPAREN) {
-            printf("Expected right parantheses match\n");
-            destroyExpressionTreeWithChildren(tree);
+            fprintf(diagnostics, "Expected right parantheses match\n");
             return nullptr;
         }
 
         s.nextToken();
         return tree;
     }
-    printf("Syntax error in %s\n", t.name.c_str());
+    std::string_view name = s.getTokenName(t);
+    fprintf(diagnostics, "Syntax error in %.*s\n", (int) name.length(), name.data());
     return nullptr;
 }
 
-Tree *parseMultiplicativeExpression() {
+// Binding power of each token as an infix operator, indexed by TokenType. Zero
+// marks tokens that end an expression.
+static const int operatorPrecedence[] = {
+    0, // TOKEN_TYPE_NULL
+    0, // TOKEN_TYPE_INTEGER
+    0, // TOKEN_TYPE_IDENTIFIER
+    1, // TOKEN_TYPE_ADD
+    1, // TOKEN_TYPE_MINUS
+    2, // TOKEN_TYPE_MUL
+    0, // TOKEN_TYPE_LPAREN
+    0, // TOKEN_TYPE_RPAREN
+};
+
+static_assert(std::size(operatorPrecedence) == TOKEN_TYPE_RPAREN + 1, "operatorPrecedence needs one entry per TokenType");
+
+static int getOperatorPrecedence(TokenType type) {
+    return operatorPrecedence[type];
+}
+
+// Precedence climbing: operators of the same level are folded in the loop,
+// so chains build left-associative trees and only a tighter operator on the
+// right costs another call.
+Tree *Parser::parseBinaryExpression(int minimumPrecedence) {
     Tree *a = parsePrimary();
-    
-    if (auto tok = s.peekToken(); matchFactor(tok)) {
+
+    for (;;) {
+        Token tok = s.peekToken();
+        int precedence = getOperatorPrecedence(tok.type);
+        if (precedence <= minimumPrecedence)
+            break;
+
         s.nextToken();
-        a = createBinaryExpressionTree(tok.type, a, parsePrimary());
-        if (tok = s.peekToken(); matchFactor(tok)) {
-            s.nextToken();
-            a = createBinaryExpressionTree(tok.type, a, parseMultiplicativeExpression());
+        a = createBinaryExpressionTree(arena, tok.type, a, parseBinaryExpression(precedence));
+    }
+    return a;
+}
+
+Tree *Parser::parseExpression() {
+    return parseBinaryExpression(0);
+}
+
+// Tree-free counterparts of parsePrimary and parseBinaryExpression: the same
+// grammar and diagnostics, but each rule returns the value its tree would
+// evaluate to, with variables and failed parses counting as 0. Nothing is
+// allocated, not even in the arena.
+std::uint64_t Parser::evaluatePrimary() {
+    Token t = s.peekToken();
+    std::uint64_t value;
+
+    if (matchToken(t, TOKEN_TYPE_INTEGER) || matchToken(t, TOKEN_TYPE_IDENTIFIER)) {
+        s.nextToken();
+        return matchToken(t, TOKEN_TYPE_INTEGER) ? t.value : 0;
+    } else if (matchToken(t, TOKEN_TYPE_LPAREN)) {
+        s.nextToken();
+        value = evaluateExpression();
+        if (t = s.peekToken(); t.type != TOKEN_TYPE_RPAREN) {
+            fprintf(diagnostics, "Expected right parantheses match\n");
+            return 0;
         }
+
+        s.nextToken();
+        return value;
     }
+    std::string_view name = s.getTokenName(t);
+    fprintf(diagnostics, "Syntax error in %.*s\n", (int) name.length(), name.data());
+    return 0;
+}
+
+std::uint64_t Parser::evaluateBinaryExpression(int minimumPrecedence) {
+    std::uint64_t a = evaluatePrimary();
 
+    for (;;) {
+        Token tok = s.peekToken();
+        int precedence = getOperatorPrecedence(tok.type);
+        if (precedence <= minimumPrecedence)
+            break;
+
+        s.nextToken();
+        a = foldBinaryOperator(tok.type, a, evaluateBinaryExpression(precedence));
+    }
     return a;
 }
 
-Tree *parseAdditiveExpression() {
-    Tree *a = parseMultiplicativeExpression();
+// Same result as evaluateConstantExpressionTree(parseExpression()) without
+// building the tree.
+std::uint64_t Parser::evaluateExpression() {
+    return evaluateBinaryExpression(0);
+}
 
-    if (auto tok = s.peekToken(); matchTerm(tok)) {
-        s.nextToken();
-        
-        a = createBinaryExpressionTree(tok.type, a, parseMultiplicativeExpression());
+void Parser::reduceOperator() {
+    TokenType op = operatorStack.back();
+    operatorStack.pop_back();
+    Tree *right = operandStack.back();
+    operandStack.pop_back();
+    operandStack.back() = createBinaryExpressionTree(arena, op, operandStack.back(), right);
+}
+
+// Shunting-yard parse of the same grammar with explicit stacks, so nesting depth
+// and chain length are bounded by heap memory rather than the native stack.
+// Operator chains associate to the left.
+Tree *Parser::parseExpressionIterative() {
+    bool expectOperand = true;
+    size_t openParentheses = 0;
 
-        if (tok = s.peekToken(); matchTerm(tok)) {
+    operandStack.clear();
+    operatorStack.clear();
+
+    for (;;) {
+        const Token& t = s.peekToken();
+
+        if (expectOperand) {
+            if (matchToken(t, TOKEN_TYPE_INTEGER) || matchToken(t, TOKEN_TYPE_IDENTIFIER)) {
+                operandStack.push_back(parseOperand(t));
+                expectOperand = false;
+            } else if (matchToken(t, TOKEN_TYPE_LPAREN)) {
+                operatorStack.push_back(TOKEN_TYPE_LPAREN);
+                openParentheses++;
+            } else {
+                std::string_view name = s.getTokenName(t);
+                fprintf(diagnostics, "Syntax error in %.*s\n", (int) name.length(), name.data());
+                return nullptr;
+            }
             s.nextToken();
-            a = createBinaryExpressionTree(tok.type, a, parseAdditiveExpression());
+            continue;
+        }
+
+        if (matchTerm(t) || matchFactor(t)) {
+            int precedence = getOperatorPrecedence(t.type);
+            while (!operatorStack.empty() && getOperatorPrecedence(operatorStack.back()) >= precedence)
+                reduceOperator();
+            operatorStack.push_back(t.type);
+            expectOperand = true;
+        } else if (matchToken(t, TOKEN_TYPE_RPAREN) && openParentheses) {
+            while (operatorStack.back() != TOKEN_TYPE_LPAREN)
+                reduceOperator();
+            operatorStack.pop_back();
+            openParentheses--;
+        } else {
+            break;
         }
+        s.nextToken();
     }
-    return a;
+
+    if (openParentheses) {
+        fprintf(diagnostics, "Expected right parantheses match\n");
+        return nullptr;
+    }
+
+    while (!operatorStack.empty())
+        reduceOperator();
+    return operandStack.back();
+}
+
+void Parser::reduceValueOperator() {
+    TokenType op = operatorStack.back();
+    operatorStack.pop_back();
+    std::uint64_t right = valueStack.back();
+    valueStack.pop_back();
+    valueStack.back() = foldBinaryOperator(op, valueStack.back(), right);
 }
 
-Tree *parseExpression() {
-    return parseAdditiveExpression();
+// Shunting-yard counterpart of evaluateExpression: folds values on an explicit
+// stack instead of building trees, so direct evaluation of deep or long input
+// never recurses.
+std::uint64_t Parser::evaluateExpressionIterative() {
+    bool expectOperand = true;
+    size_t openParentheses = 0;
+
+    valueStack.clear();
+    operatorStack.clear();
+
+    for (;;) {
+        const Token& t = s.peekToken();
+
+        if (expectOperand) {
+            if (matchToken(t, TOKEN_TYPE_INTEGER) || matchToken(t, TOKEN_TYPE_IDENTIFIER)) {
+                valueStack.push_back(matchToken(t, TOKEN_TYPE_INTEGER) ? t.value : 0);
+                expectOperand = false;
+            } else if (matchToken(t, TOKEN_TYPE_LPAREN)) {
+                operatorStack.push_back(TOKEN_TYPE_LPAREN);
+                openParentheses++;
+            } else {
+                std::string_view name = s.getTokenName(t);
+                fprintf(diagnostics, "Syntax error in %.*s\n", (int) name.length(), name.data());
+                return 0;
+            }
+            s.nextToken();
+            continue;
+        }
+
+        if (matchTerm(t) || matchFactor(t)) {
+            int precedence = getOperatorPrecedence(t.type);
+            while (!operatorStack.empty() && getOperatorPrecedence(operatorStack.back()) >= precedence)
+                reduceValueOperator();
+            operatorStack.push_back(t.type);
+            expectOperand = true;
+        } else if (matchToken(t, TOKEN_TYPE_RPAREN) && openParentheses) {
+            while (operatorStack.back() != TOKEN_TYPE_LPAREN)
+                reduceValueOperator();
+            operatorStack.pop_back();
+            openParentheses--;
+        } else {
+            break;
+        }
+        s.nextToken();
+    }
+
+    if (openParentheses) {
+        fprintf(diagnostics, "Expected right parantheses match\n");
+        return 0;
+    }
+
+    while (!operatorStack.empty())
+        reduceValueOperator();
+    return valueStack.back();
 }
 
-std::uint64_t evaluateConstantExpressionTree(Tree *expr) {
+// variables holds one value per slot of the parser's VariableTable, with no
+// bindings every variable evaluates to 0.
+std::uint64_t evaluateConstantExpressionTree(Tree *expr, const std::uint64_t *variables = nullptr) {
     std::uint64_t a, b;
     std::uint64_t result = 0;
 
@@ -294,8 +904,8 @@ std::uint64_t evaluateConstantExpressionTree(Tree *expr) {
 
     switch (expr->treeType) {
     case TREE_TYPE_BINARY_EXPRESSION:
-        a = evaluateConstantExpressionTree(static_cast<BinaryExpressionTree *>(expr)->left);
-        b = evaluateConstantExpressionTree(static_cast<BinaryExpressionTree *>(expr)->right);
+        a = evaluateConstantExpressionTree(static_cast<BinaryExpressionTree *>(expr)->left, variables);
+        b = evaluateConstantExpressionTree(static_cast<BinaryExpressionTree *>(expr)->right, variables);
         switch (static_cast<BinaryExpressionTree *>(expr)->operatorType) {
         case TOKEN_TYPE_ADD:
             result = a + b;
@@ -311,9 +921,11 @@ std::uint64_t evaluateConstantExpressionTree(Tree *expr) {
         }
         break;
     case TREE_TYPE_LITERAL:
-        return std::atoll(static_cast<LiteralTree *>(expr)->token.name.c_str());
+        return static_cast<LiteralTree *>(expr)->value;
+    case TREE_TYPE_VARIABLE:
+        return variables ? variables[static_cast<VariableTree *>(expr)->index] : 0;
     case TREE_TYPE_UNARY_EXPRESSION:
-        result = evaluateConstantExpressionTree(static_cast<UnaryExpressionTree *>(expr)->child);
+        result = evaluateConstantExpressionTree(static_cast<UnaryExpressionTree *>(expr)->child, variables);
         switch (static_cast<UnaryExpressionTree *>(expr)->operatorType) {
         case TOKEN_TYPE_MINUS:
             result = -result;
@@ -329,30 +941,2767 @@ std::uint64_t evaluateConstantExpressionTree(Tree *expr) {
     return result;
 }
 
-struct ExpressionEvaluationTester {
-    std::string buffer;
-    std::uint64_t result;
-};
+// Post-order walk with heap-allocated work and value stacks, computing the same
+// result as evaluateConstantExpressionTree without recursing per tree level.
+std::uint64_t evaluateConstantExpressionTreeIterative(Tree *expr, const std::uint64_t *variables = nullptr) {
+    struct Frame {
+        Tree *expr;
+        bool expanded;
+    };
 
-ExpressionEvaluationTester evaluations[] = {
-    { "4 + 3 * 8", 4 + 3 * 8 },
-    { "(4 + 3) * 8", (4 + 3) * 8 },
-    { "(4 + 3 * 8) + 8 * 8 + (4 * 4)", (4 + 3 * 8) + 8 * 8 + (4 * 4) }
-};
+    std::vector<Frame> work;
+    std::vector<std::uint64_t> values;
+    work.push_back({ expr, false });
 
-void testExpressions() {
-    for (auto& i : evaluations) {
-        s.setBuffer(i.buffer);
-        Tree *tree = parseExpression();
-        std::uint64_t result = evaluateConstantExpressionTree(tree);
-        
-        printf("Test %s %s :: (my result: %ld) == (compilers result: %ld)\n", result == i.result ? "passed" : "failed", i.buffer.c_str(), (std::int64_t) result, (std::int64_t) i.result);
+    while (!work.empty()) {
+        Frame frame = work.back();
+        work.pop_back();
+
+        if (!frame.expr) {
+            values.push_back(0);
+            continue;
+        }
 
-        destroyExpressionTreeWithChildren(tree);
+        switch (frame.expr->treeType) {
+        case TREE_TYPE_BINARY_EXPRESSION: {
+            BinaryExpressionTree *binary = static_cast<BinaryExpressionTree *>(frame.expr);
+            if (!frame.expanded) {
+                work.push_back({ frame.expr, true });
+                work.push_back({ binary->right, false });
+                work.push_back({ binary->left, false });
+                break;
+            }
+
+            std::uint64_t b = values.back();
+            values.pop_back();
+            std::uint64_t a = values.back();
+            std::uint64_t result = 0;
+            switch (binary->operatorType) {
+            case TOKEN_TYPE_ADD:
+                result = a + b;
+                break;
+            case TOKEN_TYPE_MINUS:
+                result = a - b;
+                break;
+            case TOKEN_TYPE_MUL:
+                result = a * b;
+                break;
+            default:
+                ;
+            }
+            values.back() = result;
+            break;
+        }
+        case TREE_TYPE_LITERAL:
+            values.push_back(static_cast<LiteralTree *>(frame.expr)->value);
+            break;
+        case TREE_TYPE_VARIABLE:
+            values.push_back(variables ? variables[static_cast<VariableTree *>(frame.expr)->index] : 0);
+            break;
+        case TREE_TYPE_UNARY_EXPRESSION: {
+            UnaryExpressionTree *unary = static_cast<UnaryExpressionTree *>(frame.expr);
+            if (!frame.expanded) {
+                work.push_back({ frame.expr, true });
+                work.push_back({ unary->child, false });
+                break;
+            }
+
+            if (unary->operatorType == TOKEN_TYPE_MINUS)
+                values.back() = -values.back();
+            break;
+        }
+        default:
+            printf("What tree is this?\n");
+            values.push_back(0);
+        }
     }
+    return values.back();
 }
 
-int main(int argc, char *argv[]) {
-    testExpressions();
-    return 0;
-}
\ No newline at end of file
+static bool isLiteral(Tree *expr, std::uint64_t value) {
+    return expr->treeType == TREE_TYPE_LITERAL && static_cast<LiteralTree *>(expr)->value == value;
+}
+
+// Builds a op b from already simplified operands. Constants are moved to the
+// right of + and *, so a chain like (x + 1) + 2 collapses into x + 3.
+static Tree *simplifyBinaryExpression(TreeArena& arena, int operatorType, Tree *a, Tree *b) {
+    if (operatorType != TOKEN_TYPE_ADD && operatorType != TOKEN_TYPE_MINUS && operatorType != TOKEN_TYPE_MUL)
+        return createLiteralTree(arena, 0);
+
+    if (a->treeType == TREE_TYPE_LITERAL && b->treeType == TREE_TYPE_LITERAL)
+        return createLiteralTree(arena, foldBinaryOperator(operatorType, static_cast<LiteralTree *>(a)->value, static_cast<LiteralTree *>(b)->value));
+
+    if (operatorType == TOKEN_TYPE_MINUS) {
+        if (b->treeType != TREE_TYPE_LITERAL)
+            return createBinaryExpressionTree(arena, operatorType, a, b);
+        operatorType = TOKEN_TYPE_ADD;
+        b = createLiteralTree(arena, -static_cast<LiteralTree *>(b)->value);
+    }
+
+    if (a->treeType == TREE_TYPE_LITERAL)
+        std::swap(a, b);
+
+    if (operatorType == TOKEN_TYPE_ADD && isLiteral(b, 0))
+        return a;
+    if (operatorType == TOKEN_TYPE_MUL && isLiteral(b, 1))
+        return a;
+    if (operatorType == TOKEN_TYPE_MUL && isLiteral(b, 0))
+        return b;
+
+    if (b->treeType == TREE_TYPE_LITERAL && a->treeType == TREE_TYPE_BINARY_EXPRESSION) {
+        BinaryExpressionTree *chain = static_cast<BinaryExpressionTree *>(a);
+        if (chain->operatorType == operatorType && chain->right->treeType == TREE_TYPE_LITERAL) {
+            std::uint64_t folded = foldBinaryOperator(operatorType, static_cast<LiteralTree *>(chain->right)->value, static_cast<LiteralTree *>(b)->value);
+            return simplifyBinaryExpression(arena, operatorType, chain->left, createLiteralTree(arena, folded));
+        }
+    }
+
+    return createBinaryExpressionTree(arena, operatorType, a, b);
+}
+
+// Returns a tree computing the same value as expr with constant subtrees folded,
+// identities (x + 0, x * 1, x * 0, - - x) removed and constants of + and * chains
+// gathered into one literal. New nodes come from arena, expr is left untouched.
+// The walk keeps its own stacks, so tree depth is bounded by heap memory.
+Tree *simplifyExpressionTree(TreeArena& arena, Tree *expr) {
+    struct Frame {
+        Tree *expr;
+        bool expanded;
+    };
+
+    std::vector<Frame> work = { { expr, false } };
+    std::vector<Tree *> results;
+
+    while (!work.empty()) {
+        Frame frame = work.back();
+        work.pop_back();
+
+        if (!frame.expr) {
+            results.push_back(createLiteralTree(arena, 0));
+            continue;
+        }
+
+        switch (frame.expr->treeType) {
+        case TREE_TYPE_BINARY_EXPRESSION: {
+            BinaryExpressionTree *binary = static_cast<BinaryExpressionTree *>(frame.expr);
+            if (!frame.expanded) {
+                work.push_back({ frame.expr, true });
+                work.push_back({ binary->right, false });
+                work.push_back({ binary->left, false });
+                break;
+            }
+
+            Tree *b = results.back();
+            results.pop_back();
+            results.back() = simplifyBinaryExpression(arena, binary->operatorType, results.back(), b);
+            break;
+        }
+        case TREE_TYPE_LITERAL:
+        case TREE_TYPE_VARIABLE:
+            results.push_back(frame.expr);
+            break;
+        case TREE_TYPE_UNARY_EXPRESSION: {
+            UnaryExpressionTree *unary = static_cast<UnaryExpressionTree *>(frame.expr);
+            if (!frame.expanded) {
+                work.push_back({ frame.expr, true });
+                work.push_back({ unary->child, false });
+                break;
+            }
+
+            Tree *child = results.back();
+            if (unary->operatorType != TOKEN_TYPE_MINUS)
+                break;
+            if (child->treeType == TREE_TYPE_LITERAL)
+                results.back() = createLiteralTree(arena, -static_cast<LiteralTree *>(child)->value);
+            else if (child->treeType == TREE_TYPE_UNARY_EXPRESSION && static_cast<UnaryExpressionTree *>(child)->operatorType == TOKEN_TYPE_MINUS)
+                results.back() = static_cast<UnaryExpressionTree *>(child)->child;
+            else
+                results.back() = createUnaryExpressionTree(arena, TOKEN_TYPE_MINUS, child);
+            break;
+        }
+        default:
+            printf("What tree is this?\n");
+            results.push_back(createLiteralTree(arena, 0));
+        }
+    }
+    return results.back();
+}
+
+// Hash-consed form of one or more trees. Every structurally distinct subtree is
+// stored once, children always before their parents, and shared subexpressions
+// form a DAG. Each interned tree becomes a formula that remembers the nodes
+// reachable from its root in id order, so evaluating it touches only its own
+// nodes however many other formulas share the DAG.
+struct ExpressionDag {
+private:
+    struct Node {
+        TreeType treeType;
+        int operatorType;
+        std::uint32_t left;
+        std::uint32_t right;
+        std::uint64_t value;
+
+        bool operator==(const Node& other) const {
+            return treeType == other.treeType && operatorType == other.operatorType && left == other.left && right == other.right && value == other.value;
+        }
+    };
+
+    struct NodeHash {
+        size_t operator()(const Node& node) const {
+            std::uint64_t h = node.value * 0x9E3779B97F4A7C15ull;
+            h ^= (std::uint64_t(node.left) << 32 | node.right) + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+            h ^= (std::uint64_t(node.treeType) << 32 | std::uint32_t(node.operatorType)) + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+            return h;
+        }
+    };
+
+    struct Formula {
+        size_t begin;
+        size_t count;
+    };
+
+    std::vector<Node> nodes;
+    std::unordered_map<Node, std::uint32_t, NodeHash> index;
+    std::vector<Formula> formulas;
+    std::vector<std::uint32_t> formulaNodes;
+    std::vector<std::uint32_t> visitMarks;
+    std::uint32_t visitEpoch = 0;
+
+    std::uint32_t internNode(const Node& node);
+    std::uint32_t internTree(Tree *expr);
+public:
+    size_t intern(Tree *expr);
+    size_t size() const { return nodes.size(); }
+    size_t getFormulaSize(size_t formula) const { return formulas[formula].count; }
+    std::uint64_t evaluate(size_t formula, const std::uint64_t *variables, std::vector<std::uint64_t>& values) const;
+    std::uint64_t evaluate(size_t formula, const std::uint64_t *variables = nullptr) const;
+};
+
+std::uint32_t ExpressionDag::internNode(const Node& node) {
+    auto [it, inserted] = index.emplace(node, (std::uint32_t) nodes.size());
+    if (inserted)
+        nodes.push_back(node);
+    return it->second;
+}
+
+// Returns the id of the node equal to expr, adding whatever parts of it are new.
+// Children are interned from an explicit work stack, not by recursion.
+std::uint32_t ExpressionDag::internTree(Tree *expr) {
+    struct Frame {
+        Tree *expr;
+        bool expanded;
+    };
+
+    std::vector<Frame> work = { { expr, false } };
+    std::vector<std::uint32_t> ids;
+
+    while (!work.empty()) {
+        Frame frame = work.back();
+        work.pop_back();
+
+        if (!frame.expr) {
+            ids.push_back(internNode({ TREE_TYPE_LITERAL, 0, 0, 0, 0 }));
+            continue;
+        }
+
+        switch (frame.expr->treeType) {
+        case TREE_TYPE_BINARY_EXPRESSION: {
+            BinaryExpressionTree *binary = static_cast<BinaryExpressionTree *>(frame.expr);
+            if (binary->operatorType != TOKEN_TYPE_ADD && binary->operatorType != TOKEN_TYPE_MINUS && binary->operatorType != TOKEN_TYPE_MUL) {
+                ids.push_back(internNode({ TREE_TYPE_LITERAL, 0, 0, 0, 0 }));
+                break;
+            }
+            if (!frame.expanded) {
+                work.push_back({ frame.expr, true });
+                work.push_back({ binary->right, false });
+                work.push_back({ binary->left, false });
+                break;
+            }
+
+            std::uint32_t right = ids.back();
+            ids.pop_back();
+            ids.back() = internNode({ TREE_TYPE_BINARY_EXPRESSION, binary->operatorType, ids.back(), right, 0 });
+            break;
+        }
+        case TREE_TYPE_LITERAL:
+            ids.push_back(internNode({ TREE_TYPE_LITERAL, 0, 0, 0, static_cast<LiteralTree *>(frame.expr)->value }));
+            break;
+        case TREE_TYPE_VARIABLE:
+            ids.push_back(internNode({ TREE_TYPE_VARIABLE, 0, 0, 0, static_cast<VariableTree *>(frame.expr)->index }));
+            break;
+        case TREE_TYPE_UNARY_EXPRESSION: {
+            UnaryExpressionTree *unary = static_cast<UnaryExpressionTree *>(frame.expr);
+            if (!frame.expanded) {
+                work.push_back({ frame.expr, true });
+                work.push_back({ unary->child, false });
+                break;
+            }
+
+            if (unary->operatorType == TOKEN_TYPE_MINUS)
+                ids.back() = internNode({ TREE_TYPE_UNARY_EXPRESSION, TOKEN_TYPE_MINUS, ids.back(), 0, 0 });
+            break;
+        }
+        default:
+            printf("What tree is this?\n");
+            ids.push_back(internNode({ TREE_TYPE_LITERAL, 0, 0, 0, 0 }));
+        }
+    }
+    return ids.back();
+}
+
+// Interns expr and records the nodes reachable from its root, sorted by id so
+// that children come first. Returns the formula id to pass to evaluate().
+size_t ExpressionDag::intern(Tree *expr) {
+    std::uint32_t root = internTree(expr);
+    std::vector<std::uint32_t> work = { root };
+    size_t begin = formulaNodes.size();
+
+    visitMarks.resize(nodes.size(), 0);
+    if (++visitEpoch == 0) {
+        std::fill(visitMarks.begin(), visitMarks.end(), 0);
+        visitEpoch = 1;
+    }
+
+    while (!work.empty()) {
+        std::uint32_t id = work.back();
+        work.pop_back();
+        if (visitMarks[id] == visitEpoch)
+            continue;
+        visitMarks[id] = visitEpoch;
+        formulaNodes.push_back(id);
+
+        const Node& node = nodes[id];
+        if (node.treeType == TREE_TYPE_BINARY_EXPRESSION) {
+            work.push_back(node.left);
+            work.push_back(node.right);
+        } else if (node.treeType == TREE_TYPE_UNARY_EXPRESSION) {
+            work.push_back(node.left);
+        }
+    }
+
+    std::sort(formulaNodes.begin() + begin, formulaNodes.end());
+    formulas.push_back({ begin, formulaNodes.size() - begin });
+    return formulas.size() - 1;
+}
+
+// Computes the formula's nodes in id order, so each shared node is evaluated
+// exactly once. values is scratch space, indexed by node id, that the caller
+// can reuse across calls.
+std::uint64_t ExpressionDag::evaluate(size_t formula, const std::uint64_t *variables, std::vector<std::uint64_t>& values) const {
+    const Formula& f = formulas[formula];
+    const std::uint32_t *ids = formulaNodes.data() + f.begin;
+
+    if (values.size() < nodes.size())
+        values.resize(nodes.size());
+
+    for (size_t n = 0; n < f.count; n++) {
+        std::uint32_t i = ids[n];
+        const Node& node = nodes[i];
+        switch (node.treeType) {
+        case TREE_TYPE_LITERAL:
+            values[i] = node.value;
+            break;
+        case TREE_TYPE_VARIABLE:
+            values[i] = variables ? variables[node.value] : 0;
+            break;
+        case TREE_TYPE_UNARY_EXPRESSION:
+            values[i] = -values[node.left];
+            break;
+        case TREE_TYPE_BINARY_EXPRESSION:
+            values[i] = foldBinaryOperator(node.operatorType, values[node.left], values[node.right]);
+            break;
+        default:
+            values[i] = 0;
+        }
+    }
+    return values[ids[f.count - 1]];
+}
+
+std::uint64_t ExpressionDag::evaluate(size_t formula, const std::uint64_t *variables) const {
+    std::vector<std::uint64_t> values;
+    return evaluate(formula, variables, values);
+}
+
+enum OpCode : std::uint8_t {
+    OPCODE_PUSH,
+    OPCODE_LOAD,
+    OPCODE_ADD,
+    OPCODE_SUB,
+    OPCODE_MUL,
+    OPCODE_NEG,
+};
+
+// Postfix stack-machine program. Opcodes take no inline operand: each
+// OPCODE_PUSH consumes the next entry of constants as its value and each
+// OPCODE_LOAD consumes the next entry as a variable slot.
+struct Bytecode {
+    std::vector<std::uint8_t> code;
+    std::vector<std::uint64_t> constants;
+    size_t maxStackDepth = 0;
+};
+
+static void emitConstant(Bytecode& bytecode, std::uint64_t value, size_t depth, OpCode op = OPCODE_PUSH) {
+    bytecode.code.push_back(op);
+    bytecode.constants.push_back(value);
+    if (depth + 1 > bytecode.maxStackDepth)
+        bytecode.maxStackDepth = depth + 1;
+}
+
+static bool getBinaryOpCode(int operatorType, OpCode& op) {
+    switch (operatorType) {
+    case TOKEN_TYPE_ADD:
+        op = OPCODE_ADD;
+        return true;
+    case TOKEN_TYPE_MINUS:
+        op = OPCODE_SUB;
+        return true;
+    case TOKEN_TYPE_MUL:
+        op = OPCODE_MUL;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Emits expr in postfix order from an explicit work stack, tracking the stack
+// depth the program will reach. Missing subtrees and unknown operators compile
+// to the same zero the tree walker would produce.
+Bytecode compileExpressionTree(Tree *expr) {
+    struct Frame {
+        Tree *expr;
+        bool expanded;
+    };
+
+    Bytecode bytecode;
+    std::vector<Frame> work = { { expr, false } };
+    size_t depth = 0;
+
+    while (!work.empty()) {
+        Frame frame = work.back();
+        work.pop_back();
+
+        if (!frame.expr) {
+            emitConstant(bytecode, 0, depth++);
+            continue;
+        }
+
+        switch (frame.expr->treeType) {
+        case TREE_TYPE_BINARY_EXPRESSION: {
+            BinaryExpressionTree *binary = static_cast<BinaryExpressionTree *>(frame.expr);
+            OpCode op;
+            if (!getBinaryOpCode(binary->operatorType, op)) {
+                emitConstant(bytecode, 0, depth++);
+                break;
+            }
+            if (!frame.expanded) {
+                work.push_back({ frame.expr, true });
+                work.push_back({ binary->right, false });
+                work.push_back({ binary->left, false });
+                break;
+            }
+
+            bytecode.code.push_back(op);
+            depth--;
+            break;
+        }
+        case TREE_TYPE_LITERAL:
+            emitConstant(bytecode, static_cast<LiteralTree *>(frame.expr)->value, depth++);
+            break;
+        case TREE_TYPE_VARIABLE:
+            emitConstant(bytecode, static_cast<VariableTree *>(frame.expr)->index, depth++, OPCODE_LOAD);
+            break;
+        case TREE_TYPE_UNARY_EXPRESSION: {
+            UnaryExpressionTree *unary = static_cast<UnaryExpressionTree *>(frame.expr);
+            if (!frame.expanded) {
+                work.push_back({ frame.expr, true });
+                work.push_back({ unary->child, false });
+                break;
+            }
+
+            if (unary->operatorType == TOKEN_TYPE_MINUS)
+                bytecode.code.push_back(OPCODE_NEG);
+            break;
+        }
+        default:
+            printf("What tree is this?\n");
+            emitConstant(bytecode, 0, depth++);
+        }
+    }
+    return bytecode;
+}
+
+// Interpreter over a bytecode program wherever its arrays live, a Bytecode or a
+// mapped formula store.
+std::uint64_t evaluateBytecodeProgram(const std::uint8_t *code, size_t codeSize, const std::uint64_t *constants, size_t maxStackDepth, const std::uint64_t *variables) {
+    std::uint64_t localStack[64];
+    std::vector<std::uint64_t> heapStack;
+    std::uint64_t *stack = localStack;
+
+    if (maxStackDepth > 64) {
+        heapStack.resize(maxStackDepth);
+        stack = heapStack.data();
+    }
+
+    const std::uint64_t *constant = constants;
+    size_t top = 0;
+    for (const std::uint8_t *op = code; op != code + codeSize; op++) {
+        switch (*op) {
+        case OPCODE_PUSH:
+            stack[top++] = *constant++;
+            break;
+        case OPCODE_LOAD:
+            stack[top++] = variables ? variables[*constant] : 0;
+            constant++;
+            break;
+        case OPCODE_ADD:
+            top--;
+            stack[top - 1] += stack[top];
+            break;
+        case OPCODE_SUB:
+            top--;
+            stack[top - 1] -= stack[top];
+            break;
+        case OPCODE_MUL:
+            top--;
+            stack[top - 1] *= stack[top];
+            break;
+        case OPCODE_NEG:
+            stack[top - 1] = -stack[top - 1];
+            break;
+        }
+    }
+    return top ? stack[top - 1] : 0;
+}
+
+std::uint64_t evaluateBytecode(const Bytecode& bytecode, const std::uint64_t *variables = nullptr) {
+    return evaluateBytecodeProgram(bytecode.code.data(), bytecode.code.size(), bytecode.constants.data(), bytecode.maxStackDepth, variables);
+}
+
+// Structure-of-arrays tree addressed by 32-bit node indices. Node i applies
+// opcodes[i] to nodes left[i] and right[i], or for OPCODE_PUSH and OPCODE_LOAD
+// takes its literal or variable slot from immediates[i]. Nodes are stored in
+// post-order, children first and the root last, and every array is plain data
+// that can be copied or written out as is.
+struct CompactTree {
+    std::vector<std::uint8_t> opcodes;
+    std::vector<std::uint32_t> left;
+    std::vector<std::uint32_t> right;
+    std::vector<std::uint64_t> immediates;
+
+    size_t size() const { return opcodes.size(); }
+    std::uint32_t getRoot() const { return (std::uint32_t) opcodes.size() - 1; }
+};
+
+static std::uint32_t appendCompactNode(CompactTree& compact, OpCode op, std::uint32_t left, std::uint32_t right, std::uint64_t immediate) {
+    compact.opcodes.push_back(op);
+    compact.left.push_back(left);
+    compact.right.push_back(right);
+    compact.immediates.push_back(immediate);
+    return compact.getRoot();
+}
+
+// Appends expr in post-order from an explicit work stack, so the node order is
+// the one evaluateCompactTree relies on whatever the tree depth.
+CompactTree createCompactTree(Tree *expr) {
+    struct Frame {
+        Tree *expr;
+        bool expanded;
+    };
+
+    CompactTree compact;
+    std::vector<Frame> work = { { expr, false } };
+    std::vector<std::uint32_t> ids;
+
+    while (!work.empty()) {
+        Frame frame = work.back();
+        work.pop_back();
+
+        if (!frame.expr) {
+            ids.push_back(appendCompactNode(compact, OPCODE_PUSH, 0, 0, 0));
+            continue;
+        }
+
+        switch (frame.expr->treeType) {
+        case TREE_TYPE_BINARY_EXPRESSION: {
+            BinaryExpressionTree *binary = static_cast<BinaryExpressionTree *>(frame.expr);
+            OpCode op;
+            if (!getBinaryOpCode(binary->operatorType, op)) {
+                ids.push_back(appendCompactNode(compact, OPCODE_PUSH, 0, 0, 0));
+                break;
+            }
+            if (!frame.expanded) {
+                work.push_back({ frame.expr, true });
+                work.push_back({ binary->right, false });
+                work.push_back({ binary->left, false });
+                break;
+            }
+
+            std::uint32_t right = ids.back();
+            ids.pop_back();
+            ids.back() = appendCompactNode(compact, op, ids.back(), right, 0);
+            break;
+        }
+        case TREE_TYPE_LITERAL:
+            ids.push_back(appendCompactNode(compact, OPCODE_PUSH, 0, 0, static_cast<LiteralTree *>(frame.expr)->value));
+            break;
+        case TREE_TYPE_VARIABLE:
+            ids.push_back(appendCompactNode(compact, OPCODE_LOAD, 0, 0, static_cast<VariableTree *>(frame.expr)->index));
+            break;
+        case TREE_TYPE_UNARY_EXPRESSION: {
+            UnaryExpressionTree *unary = static_cast<UnaryExpressionTree *>(frame.expr);
+            if (!frame.expanded) {
+                work.push_back({ frame.expr, true });
+                work.push_back({ unary->child, false });
+                break;
+            }
+
+            if (unary->operatorType == TOKEN_TYPE_MINUS)
+                ids.back() = appendCompactNode(compact, OPCODE_NEG, ids.back(), 0, 0);
+            break;
+        }
+        default:
+            printf("What tree is this?\n");
+            ids.push_back(appendCompactNode(compact, OPCODE_PUSH, 0, 0, 0));
+        }
+    }
+    return compact;
+}
+
+// One linear pass in node order: children precede their parents, so each
+// operand is already in values when its parent is reached.
+std::uint64_t evaluateCompactTree(const CompactTree& compact, const std::uint64_t *variables, std::vector<std::uint64_t>& values) {
+    size_t count = compact.size();
+    values.resize(count);
+
+    const std::uint8_t *opcodes = compact.opcodes.data();
+    const std::uint32_t *left = compact.left.data();
+    const std::uint32_t *right = compact.right.data();
+    const std::uint64_t *immediates = compact.immediates.data();
+    for (size_t i = 0; i < count; i++) {
+        switch (opcodes[i]) {
+        case OPCODE_PUSH:
+            values[i] = immediates[i];
+            break;
+        case OPCODE_LOAD:
+            values[i] = variables ? variables[immediates[i]] : 0;
+            break;
+        case OPCODE_ADD:
+            values[i] = values[left[i]] + values[right[i]];
+            break;
+        case OPCODE_SUB:
+            values[i] = values[left[i]] - values[right[i]];
+            break;
+        case OPCODE_MUL:
+            values[i] = values[left[i]] * values[right[i]];
+            break;
+        case OPCODE_NEG:
+            values[i] = -values[left[i]];
+            break;
+        }
+    }
+    return count ? values[count - 1] : 0;
+}
+
+std::uint64_t evaluateCompactTree(const CompactTree& compact, const std::uint64_t *variables = nullptr) {
+    std::vector<std::uint64_t> values;
+    return evaluateCompactTree(compact, variables, values);
+}
+
+typedef std::uint64_t (*NativeFunction)(const std::uint64_t *variables);
+
+struct JitExpression;
+
+// Executable memory shared by many JitExpressions. Machine code is bump-allocated
+// into writable chunks and seal() turns every chunk written since the last call
+// executable at once, so a batch of expressions costs a few mmap and mprotect
+// calls and its code sits densely in a few pages instead of one page each.
+// Compilation is single-threaded; the arena must outlive its expressions and
+// frees all of their code at once.
+struct JitCodeArena {
+private:
+    struct Chunk {
+        std::uint8_t *base;
+        size_t size;
+        size_t used;
+    };
+
+    struct PendingFunction {
+        JitExpression *expression;
+        const std::uint8_t *entry;
+    };
+
+    static constexpr size_t defaultChunkSize = 64 * 1024;
+    static constexpr size_t entryAlignment = 16;
+
+    std::vector<Chunk> chunks;
+    size_t sealedChunks = 0;
+    std::vector<PendingFunction> pending;
+
+    const std::uint8_t *append(const std::vector<std::uint8_t>& machineCode);
+    void forget(JitExpression *expression);
+
+    friend struct JitExpression;
+public:
+    JitCodeArena() = default;
+    JitCodeArena(const JitCodeArena&) = delete;
+    JitCodeArena& operator=(const JitCodeArena&) = delete;
+    ~JitCodeArena();
+
+    bool seal();
+};
+
+// Native x86-64 version of a compiled expression. compile() lowers the bytecode
+// into a function uint64_t(const uint64_t *variables) placed in a JitCodeArena,
+// and the expression turns native once that arena is sealed. Until then, or when
+// native code is not possible (other architectures, W^X policies, stacks too
+// deep for the native stack), evaluate() runs the bytecode interpreter.
+struct JitExpression {
+private:
+    static constexpr size_t maxNativeStackDepth = 4096;
+
+    Bytecode bytecode;
+    JitCodeArena *arena = nullptr;
+    std::unique_ptr<JitCodeArena> ownArena;
+    NativeFunction function = nullptr;
+    std::vector<std::uint64_t> unboundVariables;
+
+    bool generateNativeCode(JitCodeArena& arena);
+    void release();
+
+    friend struct JitCodeArena;
+public:
+    JitExpression() = default;
+    JitExpression(const JitExpression&) = delete;
+    JitExpression& operator=(const JitExpression&) = delete;
+    ~JitExpression() { release(); }
+
+    bool compile(Tree *expr);
+    bool compile(Tree *expr, JitCodeArena& arena);
+    bool isNative() const { return function != nullptr; }
+    std::uint64_t evaluate(const std::uint64_t *variables = nullptr) const;
+};
+
+JitCodeArena::~JitCodeArena() {
+    for (auto& p : pending)
+        p.expression->arena = nullptr;
+    for (auto& chunk : chunks)
+        munmap(chunk.base, chunk.size);
+}
+
+// Copies machineCode into the newest writable chunk, opening a new one when
+// that chunk is sealed or full. Returns nullptr when no memory can be mapped.
+const std::uint8_t *JitCodeArena::append(const std::vector<std::uint8_t>& machineCode) {
+    if (chunks.size() == sealedChunks || chunks.back().size - chunks.back().used < machineCode.size()) {
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        size_t size = std::max(defaultChunkSize, (machineCode.size() + pageSize - 1) / pageSize * pageSize);
+        void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+            return nullptr;
+        chunks.push_back({ static_cast<std::uint8_t *>(mapping), size, 0 });
+    }
+
+    Chunk& chunk = chunks.back();
+    std::uint8_t *entry = chunk.base + chunk.used;
+    std::memcpy(entry, machineCode.data(), machineCode.size());
+    chunk.used = std::min(chunk.size, (chunk.used + machineCode.size() + entryAlignment - 1) & ~(entryAlignment - 1));
+    return entry;
+}
+
+void JitCodeArena::forget(JitExpression *expression) {
+    for (size_t i = 0; i < pending.size(); i++) {
+        if (pending[i].expression == expression) {
+            pending[i] = pending.back();
+            pending.pop_back();
+            return;
+        }
+    }
+}
+
+// Makes the chunks written since the last call executable and switches the
+// expressions compiled into them to native code. Sealed chunks take no more
+// code, later compiles open a new chunk.
+bool JitCodeArena::seal() {
+    bool ok = true;
+    for (; sealedChunks < chunks.size(); sealedChunks++)
+        ok = mprotect(chunks[sealedChunks].base, chunks[sealedChunks].size, PROT_READ | PROT_EXEC) == 0 && ok;
+
+    for (auto& p : pending) {
+        if (ok)
+            p.expression->function = reinterpret_cast<NativeFunction>(const_cast<std::uint8_t *>(p.entry));
+        p.expression->arena = nullptr;
+    }
+    pending.clear();
+    return ok;
+}
+
+void JitExpression::release() {
+    if (arena)
+        arena->forget(this);
+    arena = nullptr;
+    ownArena.reset();
+    function = nullptr;
+}
+
+// Compiles into a private arena that is sealed straight away, for one-off use.
+// Prefer a shared JitCodeArena when compiling many expressions.
+bool JitExpression::compile(Tree *expr) {
+    release();
+    ownArena.reset(new JitCodeArena);
+    bytecode = compileExpressionTree(expr);
+    return generateNativeCode(*ownArena) && ownArena->seal() && isNative();
+}
+
+// Emits native code into arena; the expression runs it once arena.seal() has
+// been called and is interpreted before that.
+bool JitExpression::compile(Tree *expr, JitCodeArena& arena) {
+    release();
+    bytecode = compileExpressionTree(expr);
+    return generateNativeCode(arena);
+}
+
+std::uint64_t JitExpression::evaluate(const std::uint64_t *variables) const {
+    if (!function)
+        return evaluateBytecode(bytecode, variables);
+    return function(variables ? variables : unboundVariables.data());
+}
+
+// Top of the expression stack lives in rax, the rest on the machine stack.
+// rdi holds the variables pointer for the whole function.
+bool JitExpression::generateNativeCode(JitCodeArena& codeArena) {
+#if defined(__x86_64__)
+    if (bytecode.maxStackDepth > maxNativeStackDepth)
+        return false;
+
+    std::vector<std::uint8_t> machineCode;
+    auto emit = [&](std::initializer_list<std::uint8_t> bytes) {
+        machineCode.insert(machineCode.end(), bytes);
+    };
+    auto emitImmediate = [&](std::uint64_t value, size_t size) {
+        for (size_t i = 0; i < size; i++)
+            machineCode.push_back((std::uint8_t) (value >> (i * 8)));
+    };
+
+    const std::uint64_t *constant = bytecode.constants.data();
+    size_t depth = 0, slotCount = 0;
+    for (std::uint8_t op : bytecode.code) {
+        switch (op) {
+        case OPCODE_PUSH:
+        case OPCODE_LOAD: {
+            std::uint64_t operand = *constant++;
+            if (depth++)
+                emit({ 0x50 });                         // push rax
+            if (op == OPCODE_LOAD) {
+                if (operand >= 0x10000000)
+                    return false;
+                slotCount = std::max<size_t>(slotCount, operand + 1);
+                emit({ 0x48, 0x8B, 0x87 });             // mov rax, [rdi + disp32]
+                emitImmediate(operand * 8, 4);
+            } else if (operand <= 0xFFFFFFFF) {
+                emit({ 0xB8 });                         // mov eax, imm32
+                emitImmediate(operand, 4);
+            } else {
+                emit({ 0x48, 0xB8 });                   // mov rax, imm64
+                emitImmediate(operand, 8);
+            }
+            break;
+        }
+        case OPCODE_ADD:
+            depth--;
+            emit({ 0x59, 0x48, 0x01, 0xC8 });           // pop rcx; add rax, rcx
+            break;
+        case OPCODE_SUB:
+            depth--;
+            emit({ 0x59, 0x48, 0x29, 0xC1 });           // pop rcx; sub rcx, rax
+            emit({ 0x48, 0x89, 0xC8 });                 // mov rax, rcx
+            break;
+        case OPCODE_MUL:
+            depth--;
+            emit({ 0x59, 0x48, 0x0F, 0xAF, 0xC1 });     // pop rcx; imul rax, rcx
+            break;
+        case OPCODE_NEG:
+            emit({ 0x48, 0xF7, 0xD8 });                 // neg rax
+            break;
+        }
+    }
+    if (depth == 0)
+        emit({ 0x31, 0xC0 });                           // xor eax, eax
+    emit({ 0xC3 });                                     // ret
+
+    const std::uint8_t *entry = codeArena.append(machineCode);
+    if (!entry)
+        return false;
+
+    arena = &codeArena;
+    codeArena.pending.push_back({ this, entry });
+    unboundVariables.assign(slotCount, 0);
+    return true;
+#else
+    return false;
+#endif
+}
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__clang__)
+#define COLUMN_KERNEL __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define COLUMN_KERNEL
+#endif
+
+// Element-wise kernels over one block of rows. GCC clones them for AVX-512, AVX2
+// and baseline x86-64 and picks the widest one the CPU supports at load time.
+COLUMN_KERNEL static void addColumns(std::uint64_t *out, const std::uint64_t *a, const std::uint64_t *b, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = a[i] + b[i];
+}
+
+COLUMN_KERNEL static void subtractColumns(std::uint64_t *out, const std::uint64_t *a, const std::uint64_t *b, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = a[i] - b[i];
+}
+
+COLUMN_KERNEL static void multiplyColumns(std::uint64_t *out, const std::uint64_t *a, const std::uint64_t *b, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = a[i] * b[i];
+}
+
+COLUMN_KERNEL static void negateColumn(std::uint64_t *out, const std::uint64_t *a, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = -a[i];
+}
+
+static constexpr size_t columnBlockSize = 1024;
+
+// Runs bytecode over rowCount rows at once, one opcode per block of rows.
+// columns[slot] holds rowCount values of the variable in that slot and
+// results receives rowCount values. Stack entries point straight into the
+// input columns until an operator writes its own scratch block.
+void evaluateBytecodeColumns(const Bytecode& bytecode, const std::uint64_t *const *columns, size_t rowCount, std::uint64_t *results) {
+    size_t depth = std::max<size_t>(bytecode.maxStackDepth, 1);
+    std::vector<std::uint64_t> scratch(depth * columnBlockSize);
+    std::vector<const std::uint64_t *> stack(depth);
+
+    for (size_t rowStart = 0; rowStart < rowCount; rowStart += columnBlockSize) {
+        size_t n = std::min(columnBlockSize, rowCount - rowStart);
+        const std::uint64_t *constant = bytecode.constants.data();
+        size_t top = 0;
+
+        for (std::uint8_t op : bytecode.code) {
+            std::uint64_t *out = scratch.data() + (top ? top - 1 : 0) * columnBlockSize;
+            switch (op) {
+            case OPCODE_PUSH:
+                out = scratch.data() + top * columnBlockSize;
+                std::fill(out, out + n, *constant++);
+                stack[top++] = out;
+                break;
+            case OPCODE_LOAD:
+                stack[top++] = columns[*constant++] + rowStart;
+                break;
+            case OPCODE_ADD:
+                top--;
+                out = scratch.data() + (top - 1) * columnBlockSize;
+                addColumns(out, stack[top - 1], stack[top], n);
+                stack[top - 1] = out;
+                break;
+            case OPCODE_SUB:
+                top--;
+                out = scratch.data() + (top - 1) * columnBlockSize;
+                subtractColumns(out, stack[top - 1], stack[top], n);
+                stack[top - 1] = out;
+                break;
+            case OPCODE_MUL:
+                top--;
+                out = scratch.data() + (top - 1) * columnBlockSize;
+                multiplyColumns(out, stack[top - 1], stack[top], n);
+                stack[top - 1] = out;
+                break;
+            case OPCODE_NEG:
+                negateColumn(out, stack[top - 1], n);
+                stack[top - 1] = out;
+                break;
+            }
+        }
+
+        if (top)
+            std::copy(stack[top - 1], stack[top - 1] + n, results + rowStart);
+        else
+            std::fill(results + rowStart, results + rowStart + n, 0);
+    }
+}
+
+void evaluateExpressionTreeColumns(Tree *expr, const std::uint64_t *const *columns, size_t rowCount, std::uint64_t *results) {
+    evaluateBytecodeColumns(compileExpressionTree(expr), columns, rowCount, results);
+}
+
+// Everything needed to evaluate an expression without its text: the simplified
+// program, the names of its binding slots and, when it has no variables, the
+// final value.
+struct CompiledExpression {
+    Bytecode bytecode;
+    VariableTable variables;
+    bool isConstant = false;
+    std::uint64_t value = 0;
+
+    std::uint64_t evaluate(const std::uint64_t *bindings = nullptr) const {
+        return isConstant ? value : evaluateBytecode(bytecode, bindings);
+    }
+};
+
+// Simplifies tree in the parser's arena and compiles the result, taking the
+// variable names from the parser that produced tree.
+CompiledExpression createCompiledExpression(Parser& parser, Tree *tree) {
+    CompiledExpression expression;
+
+    tree = simplifyExpressionTree(parser.getArena(), tree);
+    expression.bytecode = compileExpressionTree(tree);
+    expression.variables = parser.getVariables();
+    if (tree->treeType == TREE_TYPE_LITERAL) {
+        expression.isConstant = true;
+        expression.value = static_cast<LiteralTree *>(tree)->value;
+    }
+    return expression;
+}
+
+// Bounded, thread-safe map from expression text to its compiled form with
+// CLOCK eviction. Keys are spread over independently locked shards, each with
+// its own slots and clock hand, so concurrent lookups of different texts rarely
+// meet on one lock. Misses are parsed outside the lock with a parser private to
+// the calling thread, so callers never lose trees or variables of their own.
+// Entries are shared, so an evicted expression stays valid for whoever still
+// holds it.
+struct ExpressionCache {
+private:
+    struct Slot {
+        std::string text;
+        std::shared_ptr<const CompiledExpression> expression;
+        bool referenced = false;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::vector<Slot> slots;
+        std::unordered_map<std::string_view, size_t> index;
+        size_t hand = 0;
+        size_t hits = 0;
+        size_t misses = 0;
+
+        size_t evictSlot();
+    };
+
+    static constexpr size_t maxShardCount = 16;
+
+    size_t shardCount;
+    std::unique_ptr<Shard[]> shards;
+
+    Shard& getShard(std::string_view text) const { return shards[std::hash<std::string_view>()(text) % shardCount]; }
+public:
+    explicit ExpressionCache(size_t capacity);
+
+    std::shared_ptr<const CompiledExpression> compile(std::string_view text);
+    std::uint64_t evaluate(std::string_view text, const std::uint64_t *bindings = nullptr);
+    size_t getHits() const;
+    size_t getMisses() const;
+};
+
+// Splits capacity over up to maxShardCount shards, rounding up so the cache
+// never holds fewer than capacity entries.
+ExpressionCache::ExpressionCache(size_t capacity) {
+    capacity = std::max<size_t>(capacity, 1);
+    shardCount = std::min(capacity, maxShardCount);
+    shards.reset(new Shard[shardCount]);
+    for (size_t i = 0; i < shardCount; i++)
+        shards[i].slots.resize((capacity + shardCount - 1) / shardCount);
+}
+
+// Advances the clock hand past recently used slots, clearing their bits, and
+// frees the first slot that has not been used since the last sweep.
+size_t ExpressionCache::Shard::evictSlot() {
+    for (;;) {
+        Slot& slot = slots[hand];
+        size_t victim = hand;
+        hand = (hand + 1) % slots.size();
+
+        if (slot.referenced) {
+            slot.referenced = false;
+            continue;
+        }
+
+        if (slot.expression)
+            index.erase(slot.text);
+        return victim;
+    }
+}
+
+std::shared_ptr<const CompiledExpression> ExpressionCache::compile(std::string_view text) {
+    Shard& shard = getShard(text);
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (auto it = shard.index.find(text); it != shard.index.end()) {
+            Slot& slot = shard.slots[it->second];
+            slot.referenced = true;
+            shard.hits++;
+            return slot.expression;
+        }
+        shard.misses++;
+    }
+
+    // Reset after every parse, so each expression's binding slots start at 0.
+    static thread_local Parser parser;
+    parser.setBufferView(text);
+    auto expression = std::make_shared<const CompiledExpression>(createCompiledExpression(parser, parser.parseExpressionIterative()));
+    parser.reset();
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (auto it = shard.index.find(text); it != shard.index.end())
+        return shard.slots[it->second].expression;
+
+    size_t victim = shard.evictSlot();
+    Slot& slot = shard.slots[victim];
+    slot.text.assign(text);
+    slot.expression = expression;
+    slot.referenced = false;
+    shard.index.emplace(slot.text, victim);
+    return expression;
+}
+
+std::uint64_t ExpressionCache::evaluate(std::string_view text, const std::uint64_t *bindings) {
+    return compile(text)->evaluate(bindings);
+}
+
+size_t ExpressionCache::getHits() const {
+    size_t hits = 0;
+    for (size_t i = 0; i < shardCount; i++) {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        hits += shards[i].hits;
+    }
+    return hits;
+}
+
+size_t ExpressionCache::getMisses() const {
+    size_t misses = 0;
+    for (size_t i = 0; i < shardCount; i++) {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        misses += shards[i].misses;
+    }
+    return misses;
+}
+
+// Work range of one batch worker. The owner and any thieves all claim chunks
+// with fetch_add on next, so a drained worker can keep stealing from others.
+// Each range has a cache line to itself so owners do not contend on each
+// other's cursors.
+struct alignas(64) BatchWorkRange {
+    std::atomic<size_t> next;
+    size_t end;
+};
+
+static constexpr size_t batchChunkSize = 256;
+
+static bool claimBatchChunk(BatchWorkRange& range, size_t& begin, size_t& end) {
+    if (range.next.load(std::memory_order_relaxed) >= range.end)
+        return false;
+    begin = range.next.fetch_add(batchChunkSize, std::memory_order_relaxed);
+    if (begin >= range.end)
+        return false;
+    end = std::min(begin + batchChunkSize, range.end);
+    return true;
+}
+
+// Parses and evaluates count independent expressions across threadCount workers
+// (0 picks the hardware concurrency), results come back in input order.
+std::vector<std::uint64_t> evaluateExpressionBatch(const std::string_view *expressions, size_t count, unsigned threadCount = 0) {
+    std::vector<std::uint64_t> results(count);
+
+    if (threadCount == 0)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    threadCount = (unsigned) std::min<size_t>(threadCount, (count + batchChunkSize - 1) / batchChunkSize);
+    if (threadCount == 0)
+        return results;
+
+    std::unique_ptr<BatchWorkRange[]> ranges(new BatchWorkRange[threadCount]);
+    size_t perWorker = count / threadCount;
+    for (unsigned i = 0; i < threadCount; i++) {
+        ranges[i].next.store(i * perWorker, std::memory_order_relaxed);
+        ranges[i].end = i + 1 == threadCount ? count : (i + 1) * perWorker;
+    }
+
+    auto worker = [&](unsigned self) {
+        Parser parser;
+        size_t begin, end;
+
+        for (unsigned victim = 0; victim < threadCount; victim++) {
+            BatchWorkRange& range = ranges[(self + victim) % threadCount];
+            while (claimBatchChunk(range, begin, end)) {
+                for (size_t i = begin; i < end; i++) {
+                    parser.setBufferView(expressions[i]);
+                    results[i] = evaluateConstantExpressionTreeIterative(parser.parseExpressionIterative());
+                    parser.reset();
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < threadCount; i++)
+        threads.emplace_back(worker, i);
+    worker(0);
+    for (auto& thread : threads)
+        thread.join();
+    return results;
+}
+
+// Writes results into a fixed buffer and hands it to the output stream in large
+// blocks instead of one stdio call per line.
+struct ResultWriter {
+private:
+    FILE *output;
+    std::vector<char> buffer;
+    size_t used = 0;
+public:
+    explicit ResultWriter(FILE *output, size_t capacity = 1 << 16) : output(output), buffer(capacity) {}
+    ~ResultWriter() { flush(); }
+
+    void write(std::uint64_t result);
+    void writeBlank();
+    void flush();
+};
+
+void ResultWriter::write(std::uint64_t result) {
+    if (buffer.size() - used < 32)
+        flush();
+    used += snprintf(buffer.data() + used, buffer.size() - used, "%" PRId64 "\n", (std::int64_t) result);
+}
+
+void ResultWriter::writeBlank() {
+    if (used == buffer.size())
+        flush();
+    buffer[used++] = '\n';
+}
+
+void ResultWriter::flush() {
+    if (used)
+        fwrite(buffer.data(), 1, used, output);
+    used = 0;
+}
+
+enum EvaluationMode {
+    EVALUATION_MODE_TREE,
+    EVALUATION_MODE_DIRECT,
+};
+
+// Writes one result line per input line so output line n always answers input
+// line n: blank lines get a blank result line.
+static void evaluateExpressionLine(Parser& parser, ResultWriter& writer, std::string_view line, EvaluationMode mode) {
+    if (!line.empty() && line.back() == '\r')
+        line.remove_suffix(1);
+    if (line.empty()) {
+        writer.writeBlank();
+        return;
+    }
+
+    parser.setBufferView(line);
+    if (mode == EVALUATION_MODE_DIRECT) {
+        writer.write(parser.evaluateExpressionIterative());
+        return;
+    }
+    writer.write(evaluateConstantExpressionTreeIterative(parser.parseExpressionIterative()));
+    parser.reset();
+}
+
+// Evaluates newline-delimited expressions from input, one result per line on
+// output. Memory stays bounded by the chunk size plus the longest line. Syntax
+// errors are reported on stderr so they cannot interleave with buffered results.
+bool evaluateExpressionStream(FILE *input, FILE *output, EvaluationMode mode = EVALUATION_MODE_TREE, size_t chunkSize = 1 << 20) {
+    Parser parser;
+    parser.setDiagnostics(stderr);
+    ResultWriter writer(output);
+    std::vector<char> buffer(chunkSize);
+    size_t pending = 0;
+
+    for (;;) {
+        if (pending == buffer.size())
+            buffer.resize(buffer.size() * 2);
+
+        size_t n = fread(buffer.data() + pending, 1, buffer.size() - pending, input);
+        if (n == 0)
+            break;
+
+        size_t end = pending + n;
+        size_t lineStart = 0;
+        for (;;) {
+            const void *newline = std::memchr(buffer.data() + lineStart, '\n', end - lineStart);
+            if (!newline)
+                break;
+            size_t lineEnd = static_cast<const char *>(newline) - buffer.data();
+            evaluateExpressionLine(parser, writer, std::string_view(buffer.data() + lineStart, lineEnd - lineStart), mode);
+            lineStart = lineEnd + 1;
+        }
+
+        pending = end - lineStart;
+        std::memmove(buffer.data(), buffer.data() + lineStart, pending);
+    }
+
+    if (pending)
+        evaluateExpressionLine(parser, writer, std::string_view(buffer.data(), pending), mode);
+    writer.flush();
+
+    if (ferror(input)) {
+        fprintf(stderr, "Failed reading expression stream\n");
+        return false;
+    }
+    return true;
+}
+
+// Read-only mapping of a whole file, unmapped when it goes out of scope.
+struct MappedFile {
+private:
+    const char *data = nullptr;
+    size_t size = 0;
+
+    void release();
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { release(); }
+
+    bool open(const char *path);
+    std::string_view getContents() const { return std::string_view(data, size); }
+};
+
+void MappedFile::release() {
+    if (data)
+        munmap(const_cast<char *>(data), size);
+    data = nullptr;
+    size = 0;
+}
+
+// Opening again drops the previous mapping first.
+bool MappedFile::open(const char *path) {
+    release();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot stat %s\n", path);
+        close(fd);
+        return false;
+    }
+
+    size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s\n", path);
+        size = 0;
+        return false;
+    }
+
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    data = static_cast<const char *>(mapping);
+    return true;
+}
+
+// Evaluates newline-delimited expressions straight out of a mapping of path,
+// the scanner reads each line in place without copying it. Like the stream mode,
+// syntax errors are reported on stderr.
+bool evaluateMappedFile(const char *path, FILE *output, EvaluationMode mode = EVALUATION_MODE_TREE) {
+    MappedFile file;
+    if (!file.open(path))
+        return false;
+
+    Parser parser;
+    parser.setDiagnostics(stderr);
+    ResultWriter writer(output);
+    std::string_view contents = file.getContents();
+
+    while (!contents.empty()) {
+        size_t lineEnd = contents.find('\n');
+        if (lineEnd == std::string_view::npos)
+            lineEnd = contents.length();
+        evaluateExpressionLine(parser, writer, contents.substr(0, lineEnd), mode);
+        contents.remove_prefix(std::min(lineEnd + 1, contents.length()));
+    }
+    return true;
+}
+
+// Binary format for compiled expressions, all integers LEB128 varints:
+//
+//   file:       "EXPR" version expression*
+//   expression: variableCount (nameLength nameBytes)* instructionCount instruction*
+//   instruction: opcode [operand]   operand only for OPCODE_PUSH and OPCODE_LOAD
+//
+// Loading rebuilds the bytecode directly, nothing is lexed or parsed.
+static constexpr char expressionFormatMagic[4] = { 'E', 'X', 'P', 'R' };
+static constexpr std::uint64_t expressionFormatVersion = 1;
+
+static void writeVarint(std::vector<std::uint8_t>& out, std::uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((std::uint8_t) (value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((std::uint8_t) value);
+}
+
+static bool readVarint(const std::uint8_t *&data, const std::uint8_t *end, std::uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 64 && data < end; shift += 7) {
+        std::uint8_t byte = *data++;
+        value |= std::uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+void writeExpressionFormatHeader(std::vector<std::uint8_t>& out) {
+    out.insert(out.end(), expressionFormatMagic, expressionFormatMagic + sizeof(expressionFormatMagic));
+    writeVarint(out, expressionFormatVersion);
+}
+
+bool readExpressionFormatHeader(const std::uint8_t *&data, const std::uint8_t *end) {
+    std::uint64_t version;
+    if ((size_t) (end - data) < sizeof(expressionFormatMagic) || std::memcmp(data, expressionFormatMagic, sizeof(expressionFormatMagic)) != 0) {
+        printf("Not a compiled expression file\n");
+        return false;
+    }
+    data += sizeof(expressionFormatMagic);
+    if (!readVarint(data, end, version) || version != expressionFormatVersion) {
+        printf("Unsupported compiled expression format version\n");
+        return false;
+    }
+    return true;
+}
+
+void writeCompiledExpression(std::vector<std::uint8_t>& out, const CompiledExpression& expression) {
+    writeVarint(out, expression.variables.size());
+    for (size_t i = 0; i < expression.variables.size(); i++) {
+        const std::string& name = expression.variables.getName(i);
+        writeVarint(out, name.length());
+        out.insert(out.end(), name.begin(), name.end());
+    }
+
+    const std::uint64_t *constant = expression.bytecode.constants.data();
+    writeVarint(out, expression.bytecode.code.size());
+    for (std::uint8_t op : expression.bytecode.code) {
+        writeVarint(out, op);
+        if (op == OPCODE_PUSH || op == OPCODE_LOAD)
+            writeVarint(out, *constant++);
+    }
+}
+
+// Reads one expression and advances data past it. The program is checked so that
+// it can never underflow the stack or load a slot it has no name for.
+bool readCompiledExpression(const std::uint8_t *&data, const std::uint8_t *end, CompiledExpression& expression) {
+    std::uint64_t variableCount, instructionCount, length, op, operand;
+    auto truncated = [] {
+        printf("Truncated compiled expression\n");
+        return false;
+    };
+    auto malformed = [] {
+        printf("Malformed compiled expression program\n");
+        return false;
+    };
+
+    expression = CompiledExpression();
+    if (!readVarint(data, end, variableCount))
+        return truncated();
+    for (std::uint64_t i = 0; i < variableCount; i++) {
+        if (!readVarint(data, end, length) || length > (std::uint64_t) (end - data))
+            return truncated();
+        std::string_view name(reinterpret_cast<const char *>(data), length);
+        if (expression.variables.getIndex(name) != i) {
+            printf("Duplicate variable %.*s in compiled expression\n", (int) name.length(), name.data());
+            return false;
+        }
+        data += length;
+    }
+
+    if (!readVarint(data, end, instructionCount) || instructionCount > (std::uint64_t) (end - data))
+        return truncated();
+    expression.bytecode.code.reserve(instructionCount);
+    for (std::uint64_t i = 0, depth = 0; i < instructionCount; i++) {
+        if (!readVarint(data, end, op))
+            return truncated();
+        switch (op) {
+        case OPCODE_PUSH:
+        case OPCODE_LOAD:
+            if (!readVarint(data, end, operand))
+                return truncated();
+            if (op == OPCODE_LOAD && operand >= variableCount) {
+                printf("Compiled expression loads unknown variable slot %" PRIu64 "\n", operand);
+                return false;
+            }
+            expression.bytecode.constants.push_back(operand);
+            expression.bytecode.maxStackDepth = std::max<size_t>(expression.bytecode.maxStackDepth, ++depth);
+            break;
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+            if (depth < 2)
+                return malformed();
+            depth--;
+            break;
+        case OPCODE_NEG:
+            if (depth < 1)
+                return malformed();
+            break;
+        default:
+            return malformed();
+        }
+        expression.bytecode.code.push_back((std::uint8_t) op);
+    }
+
+    if (expression.bytecode.code.size() == 1 && expression.bytecode.code[0] == OPCODE_PUSH) {
+        expression.isConstant = true;
+        expression.value = expression.bytecode.constants[0];
+    }
+    return true;
+}
+
+bool saveCompiledExpressions(const char *path, const std::vector<CompiledExpression>& expressions) {
+    std::vector<std::uint8_t> out;
+    writeExpressionFormatHeader(out);
+    for (auto& expression : expressions)
+        writeCompiledExpression(out, expression);
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        printf("Cannot open %s\n", path);
+        return false;
+    }
+    bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+        printf("Failed writing %s\n", path);
+    return ok;
+}
+
+bool loadCompiledExpressions(const char *path, std::vector<CompiledExpression>& expressions) {
+    MappedFile file;
+    if (!file.open(path))
+        return false;
+
+    std::string_view contents = file.getContents();
+    const std::uint8_t *data = reinterpret_cast<const std::uint8_t *>(contents.data());
+    const std::uint8_t *end = data + contents.length();
+    if (!readExpressionFormatHeader(data, end))
+        return false;
+
+    expressions.clear();
+    while (data < end) {
+        expressions.emplace_back();
+        if (!readCompiledExpression(data, end, expressions.back()))
+            return false;
+    }
+    return true;
+}
+
+// Single-file store of compiled formulas meant to be mapped and evaluated in
+// place. Everything is fixed width in native byte order and 8-byte aligned:
+//
+//   FormulaStoreHeader
+//   FormulaStoreEntry[formulaCount]                       the index, by formula id
+//   per formula, at entry.offset:
+//     uint64 constants[constantCount]
+//     uint8 code[instructionCount], padded to 8 bytes
+//     (uint32 nameLength, name bytes)[variableCount]     binding slot names
+//
+// Opening validates only the header and the size of the index, so cold start
+// costs one mmap whatever the formula count. Each formula's bounds are checked
+// when it is used and its program is verified on its first evaluate(), or all
+// at once by verify().
+struct FormulaStoreHeader {
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t formulaCount;
+};
+
+struct FormulaStoreEntry {
+    std::uint64_t offset;
+    std::uint64_t size;
+    std::uint32_t instructionCount;
+    std::uint32_t constantCount;
+    std::uint32_t variableCount;
+    std::uint32_t maxStackDepth;
+};
+
+static constexpr char formulaStoreMagic[4] = { 'E', 'X', 'P', 'S' };
+static constexpr std::uint32_t formulaStoreVersion = 1;
+
+static void appendAligned(std::vector<std::uint8_t>& out, const void *data, size_t size) {
+    const std::uint8_t *bytes = static_cast<const std::uint8_t *>(data);
+    out.insert(out.end(), bytes, bytes + size);
+    out.resize((out.size() + 7) & ~size_t(7));
+}
+
+bool saveFormulaStore(const char *path, const std::vector<CompiledExpression>& expressions) {
+    FormulaStoreHeader header = {};
+    std::memcpy(header.magic, formulaStoreMagic, sizeof(header.magic));
+    header.version = formulaStoreVersion;
+    header.formulaCount = expressions.size();
+
+    std::vector<FormulaStoreEntry> index(expressions.size());
+    std::vector<std::uint8_t> bodies;
+    size_t bodiesOffset = sizeof(FormulaStoreHeader) + index.size() * sizeof(FormulaStoreEntry);
+
+    for (size_t i = 0; i < expressions.size(); i++) {
+        const Bytecode& bytecode = expressions[i].bytecode;
+        const VariableTable& variables = expressions[i].variables;
+        FormulaStoreEntry& entry = index[i];
+
+        entry.offset = bodiesOffset + bodies.size();
+        entry.instructionCount = (std::uint32_t) bytecode.code.size();
+        entry.constantCount = (std::uint32_t) bytecode.constants.size();
+        entry.variableCount = (std::uint32_t) variables.size();
+        entry.maxStackDepth = (std::uint32_t) bytecode.maxStackDepth;
+
+        appendAligned(bodies, bytecode.constants.data(), bytecode.constants.size() * sizeof(std::uint64_t));
+        appendAligned(bodies, bytecode.code.data(), bytecode.code.size());
+        for (size_t slot = 0; slot < variables.size(); slot++) {
+            std::uint32_t length = (std::uint32_t) variables.getName(slot).length();
+            bodies.insert(bodies.end(), reinterpret_cast<const std::uint8_t *>(&length), reinterpret_cast<const std::uint8_t *>(&length + 1));
+            bodies.insert(bodies.end(), variables.getName(slot).begin(), variables.getName(slot).end());
+        }
+        bodies.resize((bodies.size() + 7) & ~size_t(7));
+        entry.size = bodiesOffset + bodies.size() - entry.offset;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        printf("Cannot open %s\n", path);
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && (index.empty() || fwrite(index.data(), sizeof(FormulaStoreEntry), index.size(), file) == index.size());
+    ok = ok && fwrite(bodies.data(), 1, bodies.size(), file) == bodies.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+        printf("Failed writing %s\n", path);
+    return ok;
+}
+
+struct FormulaStore {
+private:
+    MappedFile file;
+    const std::uint8_t *base = nullptr;
+    size_t fileSize = 0;
+    const FormulaStoreEntry *index = nullptr;
+    size_t formulaCount = 0;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> verified;
+
+    bool isInBounds(const FormulaStoreEntry& entry) const;
+    bool verifyFormula(size_t id) const;
+    const std::uint64_t *getConstants(const FormulaStoreEntry& entry) const {
+        return reinterpret_cast<const std::uint64_t *>(base + entry.offset);
+    }
+    const std::uint8_t *getCode(const FormulaStoreEntry& entry) const {
+        return base + entry.offset + entry.constantCount * sizeof(std::uint64_t);
+    }
+public:
+    bool open(const char *path);
+    bool verify() const;
+    size_t size() const { return formulaCount; }
+    std::uint64_t evaluate(size_t id, const std::uint64_t *variables = nullptr) const;
+    size_t getVariableCount(size_t id) const { return id < formulaCount ? index[id].variableCount : 0; }
+    std::string_view getVariableName(size_t id, size_t slot) const;
+};
+
+bool FormulaStore::open(const char *path) {
+    base = nullptr;
+    fileSize = 0;
+    index = nullptr;
+    formulaCount = 0;
+    verified.reset();
+    if (!file.open(path))
+        return false;
+
+    std::string_view contents = file.getContents();
+    const FormulaStoreHeader *header = reinterpret_cast<const FormulaStoreHeader *>(contents.data());
+    if (contents.length() < sizeof(FormulaStoreHeader) || std::memcmp(header->magic, formulaStoreMagic, sizeof(header->magic)) != 0) {
+        printf("%s is not a formula store\n", path);
+        return false;
+    }
+    if (header->version != formulaStoreVersion) {
+        printf("Unsupported formula store version %u\n", header->version);
+        return false;
+    }
+
+    size_t available = (contents.length() - sizeof(FormulaStoreHeader)) / sizeof(FormulaStoreEntry);
+    if (header->formulaCount > available) {
+        printf("Truncated formula store index\n");
+        return false;
+    }
+
+    base = reinterpret_cast<const std::uint8_t *>(contents.data());
+    fileSize = contents.length();
+    index = reinterpret_cast<const FormulaStoreEntry *>(base + sizeof(FormulaStoreHeader));
+    formulaCount = header->formulaCount;
+    verified.reset(new std::atomic<std::uint64_t>[(formulaCount + 63) / 64]());
+    return true;
+}
+
+bool FormulaStore::isInBounds(const FormulaStoreEntry& entry) const {
+    size_t needed = entry.constantCount * sizeof(std::uint64_t) + entry.instructionCount;
+    return entry.offset % 8 == 0 && entry.offset <= fileSize && entry.size <= fileSize - entry.offset && needed <= entry.size;
+}
+
+// Checks a stored program the way readCompiledExpression checks a decoded one:
+// known opcodes, no stack underflow, operands and loads within their arrays. The
+// stored stack depth must be exactly the one the program reaches, since the
+// interpreter allocates that much stack up front.
+static bool verifyStoredProgram(const FormulaStoreEntry& entry, const std::uint64_t *constants, const std::uint8_t *code) {
+    size_t depth = 0, maxDepth = 0, constant = 0;
+
+    for (std::uint32_t pc = 0; pc < entry.instructionCount; pc++) {
+        switch (code[pc]) {
+        case OPCODE_PUSH:
+        case OPCODE_LOAD:
+            if (constant >= entry.constantCount)
+                return false;
+            if (code[pc] == OPCODE_LOAD && constants[constant] >= entry.variableCount)
+                return false;
+            constant++;
+            maxDepth = std::max(maxDepth, ++depth);
+            break;
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+            if (depth < 2)
+                return false;
+            depth--;
+            break;
+        case OPCODE_NEG:
+            if (depth < 1)
+                return false;
+            break;
+        default:
+            return false;
+        }
+    }
+    return maxDepth == entry.maxStackDepth;
+}
+
+// Checks formula id once and remembers the outcome in one bit per formula, so
+// evaluate() never runs a program whose bounds, opcodes or loads are unchecked.
+bool FormulaStore::verifyFormula(size_t id) const {
+    std::uint64_t bit = std::uint64_t(1) << (id % 64);
+    if (verified[id / 64].load(std::memory_order_acquire) & bit)
+        return true;
+
+    const FormulaStoreEntry& entry = index[id];
+    if (!isInBounds(entry)) {
+        printf("Formula %zu lies outside the store\n", id);
+        return false;
+    }
+    if (!verifyStoredProgram(entry, getConstants(entry), getCode(entry))) {
+        printf("Formula %zu has a malformed program\n", id);
+        return false;
+    }
+    verified[id / 64].fetch_or(bit, std::memory_order_release);
+    return true;
+}
+
+bool FormulaStore::verify() const {
+    for (size_t i = 0; i < formulaCount; i++)
+        if (!verifyFormula(i))
+            return false;
+    return true;
+}
+
+std::uint64_t FormulaStore::evaluate(size_t id, const std::uint64_t *variables) const {
+    if (id >= formulaCount) {
+        printf("No formula %zu in store\n", id);
+        return 0;
+    }
+    if (!verifyFormula(id))
+        return 0;
+
+    const FormulaStoreEntry& entry = index[id];
+    return evaluateBytecodeProgram(getCode(entry), entry.instructionCount, getConstants(entry), entry.maxStackDepth, variables);
+}
+
+std::string_view FormulaStore::getVariableName(size_t id, size_t slot) const {
+    if (id >= formulaCount || slot >= index[id].variableCount || !isInBounds(index[id]))
+        return {};
+
+    const FormulaStoreEntry& entry = index[id];
+    const std::uint8_t *end = base + entry.offset + entry.size;
+    const std::uint8_t *name = getCode(entry) + ((entry.instructionCount + 7) & ~std::uint32_t(7));
+    for (size_t i = 0;; i++) {
+        std::uint32_t length;
+        if ((size_t) (end - name) < sizeof(length))
+            return {};
+        std::memcpy(&length, name, sizeof(length));
+        name += sizeof(length);
+        if (length > (size_t) (end - name))
+            return {};
+        if (i == slot)
+            return std::string_view(reinterpret_cast<const char *>(name), length);
+        name += length;
+    }
+}
+
+// Never constexpr: reaching it while evaluating a constant expression at compile
+// time turns the malformed input into a compile error.
+static void reportConstantExpressionError(const char *message) {
+    printf("%s\n", message);
+}
+
+// Allocation-free parse-and-evaluate of the integer grammar, usable in constant
+// expressions. Operator chains associate to the left.
+struct ConstantExpressionEvaluator {
+private:
+    std::string_view buffer;
+    size_t position = 0;
+
+    constexpr Character peekCharacter() {
+        while (position < buffer.length() && isWhitespace(buffer[position]))
+            position++;
+        return position < buffer.length() ? buffer[position] : 0;
+    }
+
+    constexpr std::uint64_t evaluatePrimary() {
+        Character c = peekCharacter();
+
+        if (beginsWithDigit(c)) {
+            std::uint64_t value = 0;
+            while (position < buffer.length() && beginsWithDigit(buffer[position]))
+                value = value * 10 + (buffer[position++] - '0');
+            if (position < buffer.length() && (isIdentifier(buffer[position]) || buffer[position] == '.'))
+                reportConstantExpressionError("Trailing characters after integer");
+            return value;
+        }
+
+        if (c == '(') {
+            position++;
+            std::uint64_t value = evaluateAdditive();
+            if (peekCharacter() != ')') {
+                reportConstantExpressionError("Expected right parantheses match");
+                return 0;
+            }
+            position++;
+            return value;
+        }
+
+        reportConstantExpressionError("Syntax error in constant expression");
+        return 0;
+    }
+
+    constexpr std::uint64_t evaluateMultiplicative() {
+        std::uint64_t value = evaluatePrimary();
+        while (peekCharacter() == '*') {
+            position++;
+            value *= evaluatePrimary();
+        }
+        return value;
+    }
+
+    constexpr std::uint64_t evaluateAdditive() {
+        std::uint64_t value = evaluateMultiplicative();
+        for (Character c = peekCharacter(); c == '+' || c == '-'; c = peekCharacter()) {
+            position++;
+            std::uint64_t right = evaluateMultiplicative();
+            value = c == '+' ? value + right : value - right;
+        }
+        return value;
+    }
+public:
+    constexpr explicit ConstantExpressionEvaluator(std::string_view buffer) : buffer(buffer) {}
+
+    constexpr std::uint64_t evaluate() {
+        std::uint64_t value = evaluateAdditive();
+        if (peekCharacter() != 0)
+            reportConstantExpressionError("Unexpected trailing input in constant expression");
+        return value;
+    }
+};
+
+constexpr std::uint64_t evaluateConstantExpression(std::string_view buffer) {
+    return ConstantExpressionEvaluator(buffer).evaluate();
+}
+
+struct ExpressionEvaluationTester {
+    const char *buffer;
+    std::uint64_t result;
+};
+
+constexpr ExpressionEvaluationTester evaluations[] = {
+    { "4 + 3 * 8", 4 + 3 * 8 },
+    { "(4 + 3) * 8", (4 + 3) * 8 },
+    { "(4 + 3 * 8) + 8 * 8 + (4 * 4)", (4 + 3 * 8) + 8 * 8 + (4 * 4) },
+    { "123456789012345678 * 1000000007 + 18446744073709551615", 123456789012345678ull * 1000000007ull + 18446744073709551615ull },
+    { "1                                                                        +                                                                                   2", 1 + 2 },
+    { "1 - 2 - 3 - 4", std::uint64_t(1 - 2 - 3 - 4) },
+    { "2 * 3 - 4 - 5 * 6 * 7 - 8 + 9", std::uint64_t(2 * 3 - 4 - 5 * 6 * 7 - 8 + 9) }
+};
+
+constexpr bool testConstantExpressions() {
+    for (auto& i : evaluations)
+        if (evaluateConstantExpression(i.buffer) != i.result)
+            return false;
+    return true;
+}
+
+static_assert(testConstantExpressions(), "constexpr evaluator disagrees with the evaluations table");
+static_assert(evaluateConstantExpression("1 - 2 - 3 - 4") == std::uint64_t(1 - 2 - 3 - 4), "subtraction associates to the left");
+static_assert((literal(4) + 3 * literal(8)).evaluate() == evaluateConstantExpression("4 + 3 * 8"), "expression templates disagree with the constexpr evaluator");
+static_assert((-(literal(0) - 1) * 18446744073709551615ull).evaluate() == evaluateConstantExpression("18446744073709551615 * 1"), "expression templates wrap modulo 2^64");
+
+void testExpressions() {
+    Parser parser;
+
+    for (auto& i : evaluations) {
+        parser.setBufferView(i.buffer);
+        Tree *tree = parser.parseExpression();
+        std::uint64_t result = evaluateConstantExpressionTree(tree);
+        std::uint64_t bytecodeResult = evaluateBytecode(compileExpressionTree(tree));
+        bool passed = result == i.result && bytecodeResult == i.result && evaluateConstantExpressionTreeIterative(tree) == i.result;
+
+        JitExpression jit;
+        jit.compile(tree);
+        passed = passed && jit.evaluate() == i.result && evaluateCompactTree(createCompactTree(tree)) == i.result;
+
+        Tree *simplified = simplifyExpressionTree(parser.getArena(), tree);
+        passed = passed && simplified->treeType == TREE_TYPE_LITERAL && evaluateConstantExpressionTree(simplified) == i.result;
+
+        parser.setBufferView(i.buffer);
+        passed = passed && evaluateConstantExpressionTreeIterative(parser.parseExpressionIterative()) == i.result;
+
+        printf("Test %s %s :: (my result: %ld, bytecode result: %ld) == (compilers result: %ld)\n", passed ? "passed" : "failed", i.buffer, (std::int64_t) result, (std::int64_t) bytecodeResult, (std::int64_t) i.result);
+
+        parser.reset();
+    }
+
+    // Every table formula in one shared code arena: interpreted until the arena
+    // is sealed, native afterwards, and an expression dropped before sealing
+    // leaves nothing behind.
+    JitCodeArena codeArena;
+    std::vector<JitExpression> programs(std::size(evaluations));
+    size_t failures = 0;
+    for (size_t n = 0; n < programs.size(); n++) {
+        parser.setBufferView(evaluations[n].buffer);
+        programs[n].compile(parser.parseExpressionIterative(), codeArena);
+        if (programs[n].isNative() || programs[n].evaluate() != evaluations[n].result)
+            failures++;
+        parser.reset();
+    }
+    {
+        JitExpression dropped;
+        parser.setBufferView("1 + 2");
+        dropped.compile(parser.parseExpressionIterative(), codeArena);
+        parser.reset();
+    }
+    codeArena.seal();
+    for (size_t n = 0; n < programs.size(); n++)
+        if (programs[n].evaluate() != evaluations[n].result)
+            failures++;
+    printf("Test %s shared JIT code arena :: %zu failures (%s)\n", failures ? "failed" : "passed", failures, programs[0].isNative() ? "native" : "interpreted");
+
+    // Every isspace character separates tokens, leading and trailing included.
+    const char *spaced = "\t1 +\r\n2\v*\f3 ";
+    parser.setBufferView(spaced);
+    std::uint64_t result = evaluateConstantExpressionTree(parser.parseExpression());
+    parser.reset();
+    parser.setBufferView(spaced);
+    bool passed = result == 7 && parser.evaluateExpressionIterative() == 7 && evaluateConstantExpression(spaced) == 7;
+    printf("Test %s tabs, line breaks and form feeds as whitespace :: (my result: %" PRId64 ") == (expected: 7)\n", passed ? "passed" : "failed", (std::int64_t) result);
+}
+
+void testBatchEvaluation() {
+    std::vector<std::string_view> expressions;
+    for (size_t n = 0; n < 10000; n++)
+        for (auto& i : evaluations)
+            expressions.push_back(i.buffer);
+
+    std::vector<std::uint64_t> results = evaluateExpressionBatch(expressions.data(), expressions.size(), 4);
+    size_t failures = 0;
+    for (size_t i = 0; i < results.size(); i++)
+        if (results[i] != evaluations[i % std::size(evaluations)].result)
+            failures++;
+
+    printf("Test %s batch evaluation of %zu expressions (%zu failures)\n", failures ? "failed" : "passed", expressions.size(), failures);
+}
+
+struct VariableEvaluationTester {
+    const char *buffer;
+    std::uint64_t (*expected)(std::uint64_t x, std::uint64_t y);
+};
+
+VariableEvaluationTester variableEvaluations[] = {
+    { "x * x + 2 * y - 1", [](std::uint64_t x, std::uint64_t y) { return x * x + 2 * y - 1; } },
+    { "((x + 1) + 2) * 1 + y * 0", [](std::uint64_t x, std::uint64_t y) { return x + 3; } },
+    { "(x - 5) * (y + 0) * 3 * 4", [](std::uint64_t x, std::uint64_t y) { return (x - 5) * y * 12; } },
+};
+
+// Each formula is parsed once and evaluated against many bindings through the
+// tree walkers, the bytecode and the simplified tree.
+void testVariableExpressions() {
+    Parser parser;
+
+    for (auto& i : variableEvaluations) {
+        parser.setBufferView(i.buffer);
+        Tree *tree = parser.parseExpression();
+        Tree *simplified = simplifyExpressionTree(parser.getArena(), tree);
+        Bytecode bytecode = compileExpressionTree(tree);
+        CompactTree compact = createCompactTree(tree);
+        JitExpression jit;
+        jit.compile(tree);
+        const VariableTable& variables = parser.getVariables();
+        size_t x = 0, y = 0;
+        bool hasX = variables.findIndex("x", x), hasY = variables.findIndex("y", y);
+        std::uint64_t values[2];
+        size_t failures = 0;
+
+        for (std::uint64_t n = 0; n < 1000; n++) {
+            std::uint64_t valueX = n * 7919, valueY = n * n - 3;
+            if (hasX)
+                values[x] = valueX;
+            if (hasY)
+                values[y] = valueY;
+
+            std::uint64_t expected = i.expected(valueX, valueY);
+            if (evaluateConstantExpressionTree(tree, values) != expected || evaluateConstantExpressionTreeIterative(tree, values) != expected
+                || evaluateBytecode(bytecode, values) != expected || evaluateConstantExpressionTree(simplified, values) != expected
+                || jit.evaluate(values) != expected || evaluateCompactTree(compact, values) != expected)
+                failures++;
+        }
+
+        printf("Test %s %s :: %zu of 1000 bindings failed (%s)\n", failures ? "failed" : "passed", i.buffer, failures, jit.isNative() ? "native" : "interpreted");
+
+        const size_t rowCount = 5000;
+        std::vector<std::uint64_t> columnX(rowCount), columnY(rowCount), results(rowCount);
+        const std::uint64_t *columns[2];
+        for (size_t n = 0; n < rowCount; n++) {
+            columnX[n] = n * 7919;
+            columnY[n] = n * n - 3;
+        }
+        if (hasX)
+            columns[x] = columnX.data();
+        if (hasY)
+            columns[y] = columnY.data();
+
+        failures = 0;
+        evaluateExpressionTreeColumns(tree, columns, rowCount, results.data());
+        for (size_t n = 0; n < rowCount; n++)
+            if (results[n] != i.expected(columnX[n], columnY[n]))
+                failures++;
+        printf("Test %s %s :: %zu of %zu column rows failed\n", failures ? "failed" : "passed", i.buffer, failures, rowCount);
+        parser.reset();
+    }
+
+    // Many distinct names, each repeated once, must get one slot apiece in order
+    // of first appearance, also in a copy that outlives the parser's table.
+    const size_t variableCount = 20000;
+    std::string buffer = "v0";
+    for (size_t n = 1; n < variableCount; n++)
+        buffer += " + v" + std::to_string(n);
+    for (size_t n = 0; n < variableCount; n++)
+        buffer += " - v" + std::to_string(n);
+    buffer += " + v123";
+    parser.setBufferView(buffer);
+    Tree *tree = parser.parseExpressionIterative();
+    std::vector<std::uint64_t> values(variableCount);
+    for (size_t n = 0; n < variableCount; n++)
+        values[n] = n * 31;
+    std::uint64_t result = evaluateConstantExpressionTreeIterative(tree, values.data());
+    VariableTable copy = parser.getVariables();
+    parser.reset();
+
+    size_t slot = 0;
+    bool passed = result == 123 * 31 && copy.size() == variableCount && copy.findIndex("v123", slot) && slot == 123 && copy.getName(slot) == "v123";
+    printf("Test %s %zu distinct variables :: %zu slots\n", passed ? "passed" : "failed", variableCount, copy.size());
+}
+
+// The expression templates must agree with the parsed formula bit for bit,
+// including wraparound.
+void testExpressionTemplates() {
+    const char *buffer = "(x - 5) * (y + 0) * 3 * 4 - x * 18446744073709551615";
+    constexpr auto x = variable(0), y = variable(1);
+    constexpr auto formula = (x - 5) * (y + 0) * 3 * 4 - x * 18446744073709551615ull;
+    Parser parser;
+    size_t failures = 0;
+
+    parser.setBufferView(buffer);
+    Tree *tree = parser.parseExpression();
+    for (std::uint64_t n = 0; n < 1000; n++) {
+        std::uint64_t values[2] = { n * 0x9E3779B97F4A7C15ull, n - 500 };
+        if (formula.evaluate(values) != evaluateConstantExpressionTree(tree, values))
+            failures++;
+    }
+
+    printf("Test %s expression template %s :: %zu of 1000 bindings failed\n", failures ? "failed" : "passed", buffer, failures);
+}
+
+// Dispatch runs only the widest counter the host supports, so every compiled
+// variant is called directly here and compared with the scalar loop: lengths
+// 0 to 130 at every alignment, with the run ending at every position including
+// the 16, 32 and 64 byte register boundaries.
+void testCharacterRunCounters() {
+    struct Variant {
+        const char *name;
+        CharacterRunCounters counters;
+        bool supported;
+    };
+
+    std::vector<Variant> variants = { { "scalar", { countDigitsScalar, countWhitespaceScalar }, true } };
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    variants.push_back({ "sse2", { countDigitsSse2, countWhitespaceSse2 }, true });
+    variants.push_back({ "avx2", { countDigitsAvx2, countWhitespaceAvx2 }, (bool) __builtin_cpu_supports("avx2") });
+    variants.push_back({ "avx512", { countDigitsAvx512, countWhitespaceAvx512 }, (bool) __builtin_cpu_supports("avx512bw") });
+#endif
+
+    const char digits[] = "0123456789", digitStops[] = "/:a ";
+    const char spaces[] = " \t\n\v\f\r", spaceStops[] = "\x08\x0e!0";
+    alignas(64) char storage[64 + 131];
+
+    for (auto& variant : variants) {
+        if (!variant.supported) {
+            printf("Test skipped %s character run counters :: not supported by this CPU\n", variant.name);
+            continue;
+        }
+
+        size_t failures = 0;
+        for (size_t alignment = 0; alignment < 64; alignment++) {
+            char *p = storage + alignment;
+            for (size_t n = 0; n <= 130; n++) {
+                for (size_t i = 0; i < n; i++)
+                    p[i] = digits[i % 10];
+                for (size_t run = 0; run <= n; run++) {
+                    if (run < n)
+                        p[run] = digitStops[run % 4];
+                    if (variant.counters.countDigits(p, n) != countDigitsScalar(p, n))
+                        failures++;
+                    if (run < n)
+                        p[run] = digits[run % 10];
+                }
+
+                for (size_t i = 0; i < n; i++)
+                    p[i] = spaces[i % 6];
+                for (size_t run = 0; run <= n; run++) {
+                    if (run < n)
+                        p[run] = spaceStops[run % 4];
+                    if (variant.counters.countWhitespace(p, n) != countWhitespaceScalar(p, n))
+                        failures++;
+                    if (run < n)
+                        p[run] = spaces[run % 6];
+                }
+            }
+        }
+        printf("Test %s %s character run counters :: %zu failures\n", failures ? "failed" : "passed", variant.name, failures);
+    }
+}
+
+// Direct evaluation must match the tree path exactly, malformed input included.
+void testDirectEvaluation() {
+    const char *malformed[] = { "(1 + 2", "1 + * 2", "2 * (3 + 4))", "x * 3 + 4", "" };
+    Parser parser;
+    size_t failures = 0, count = 0;
+
+    auto check = [&](const char *buffer) {
+        parser.setBufferView(buffer);
+        std::uint64_t expected = evaluateConstantExpressionTree(parser.parseExpression());
+        parser.reset();
+        parser.setBufferView(buffer);
+        if (parser.evaluateExpression() != expected)
+            failures++;
+        count++;
+    };
+
+    for (auto& i : evaluations)
+        check(i.buffer);
+    for (auto& i : variableEvaluations)
+        check(i.buffer);
+    for (auto buffer : malformed)
+        check(buffer);
+
+    printf("Test %s direct evaluation :: %zu of %zu expressions differ from the tree path\n", failures ? "failed" : "passed", failures, count);
+}
+
+// Repeated subexpressions collapse to one node each and still evaluate to the
+// same value as the tree they came from.
+void testExpressionDag() {
+    const char *buffer = "(x * y + 3) * (x * y + 3) + (x * y + 3)";
+    Parser parser;
+    ExpressionDag dag;
+    std::vector<std::uint64_t> scratch;
+    size_t failures = 0;
+
+    parser.setBufferView(buffer);
+    Tree *tree = parser.parseExpression();
+    size_t formula = dag.intern(tree);
+    size_t sharedNodes = dag.size();
+    for (std::uint64_t n = 0; n < 1000; n++) {
+        std::uint64_t values[2] = { n * 31, n * n + 5 };
+        if (dag.evaluate(formula, values, scratch) != evaluateConstantExpressionTree(tree, values))
+            failures++;
+    }
+    parser.reset();
+
+    for (auto& i : evaluations) {
+        parser.setBufferView(i.buffer);
+        if (dag.evaluate(dag.intern(parser.parseExpression())) != i.result)
+            failures++;
+        parser.reset();
+    }
+
+    // A later formula with fewer binding slots must only read its own slots and
+    // only evaluate its own nodes.
+    ExpressionDag shared;
+    parser.setBufferView("p + q + r + s + t");
+    shared.intern(parser.parseExpression());
+    parser.reset();
+    parser.setBufferView("x * 2");
+    size_t second = shared.intern(parser.parseExpression());
+    parser.reset();
+    std::uint64_t binding[1] = { 21 };
+    if (shared.evaluate(second, binding) != 42 || shared.getFormulaSize(second) != 3)
+        failures++;
+
+    printf("Test %s expression DAG %s :: %zu failures, 7 == (shared nodes: %zu)\n", failures || sharedNodes != 7 ? "failed" : "passed", buffer, failures, sharedNodes);
+}
+
+// A cache smaller than the table keeps evicting, yet every lookup must still
+// produce the right value and repeated formulas must hit.
+void testExpressionCache() {
+    ExpressionCache cache(4);
+    size_t failures = 0;
+
+    for (size_t n = 0; n < 100; n++) {
+        for (auto& i : evaluations)
+            if (cache.evaluate(i.buffer) != i.result)
+                failures++;
+        if (cache.evaluate("4 + 3 * 8") != 28)
+            failures++;
+    }
+
+    // A tree the caller is holding survives misses, and an earlier formula's
+    // variables never become slots of a later one.
+    Parser parser;
+    parser.setBufferView("a * b");
+    Tree *tree = parser.parseExpression();
+    std::uint64_t bindings[2] = { 6, 7 };
+    if (cache.compile("p + q + r")->variables.size() != 3 || cache.compile("z * 3")->variables.size() != 1 ||
+        cache.evaluate("z * 3", bindings) != 18 || evaluateConstantExpressionTree(tree, bindings) != 42)
+        failures++;
+
+    auto formula = cache.compile("x * x + 2 * y - 1");
+    size_t x = 0, y = 0;
+    formula->variables.findIndex("x", x);
+    formula->variables.findIndex("y", y);
+    std::uint64_t values[2];
+    values[x] = 7;
+    values[y] = 11;
+    if (formula->isConstant || formula->evaluate(values) != 7 * 7 + 2 * 11 - 1)
+        failures++;
+
+    printf("Test %s expression cache :: %zu failures, %zu hits, %zu misses\n", failures ? "failed" : "passed", failures, cache.getHits(), cache.getMisses());
+}
+
+// Threads hammer one small cache with overlapping keys, so hits, misses racing
+// on the same text and evictions all interleave. Every result must match the
+// uncached tree path.
+void testConcurrentExpressionCache() {
+    const unsigned threadCount = 8;
+    const size_t keyCount = 96, rounds = 200;
+    ExpressionCache cache(32);
+    std::vector<std::string> keys;
+    std::vector<std::uint64_t> expected;
+    Parser parser;
+    std::uint64_t bindings[2] = { 12345, 678 };
+
+    for (size_t i = 0; i < keyCount; i++) {
+        keys.push_back(std::to_string(i) + " * x + y * " + std::to_string(i % 7) + " - " + std::to_string(i % 11));
+        parser.setBufferView(keys.back());
+        Tree *tree = parser.parseExpressionIterative();
+        size_t x = 0, y = 0;
+        parser.getVariables().findIndex("x", x);
+        parser.getVariables().findIndex("y", y);
+        std::uint64_t values[2];
+        values[x] = bindings[0];
+        values[y] = bindings[1];
+        expected.push_back(evaluateConstantExpressionTreeIterative(tree, values));
+        parser.reset();
+    }
+
+    std::atomic<size_t> failures{0};
+    auto worker = [&](unsigned self) {
+        for (size_t round = 0; round < rounds; round++) {
+            for (size_t n = 0; n < keyCount; n++) {
+                size_t key = (n * (self + 1) + round) % keyCount;
+                auto formula = cache.compile(keys[key]);
+                size_t x = 0, y = 0;
+                formula->variables.findIndex("x", x);
+                formula->variables.findIndex("y", y);
+                std::uint64_t values[2];
+                values[x] = bindings[0];
+                values[y] = bindings[1];
+                if (formula->evaluate(values) != expected[key])
+                    failures.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < threadCount; i++)
+        threads.emplace_back(worker, i);
+    for (auto& thread : threads)
+        thread.join();
+
+    size_t lookups = cache.getHits() + cache.getMisses();
+    bool passed = failures == 0 && lookups == threadCount * keyCount * rounds;
+    printf("Test %s concurrent expression cache :: %zu failures, %zu of %zu lookups counted\n", passed ? "passed" : "failed", failures.load(), lookups, threadCount * keyCount * rounds);
+}
+
+// Every table formula must survive a round trip through the binary format, and
+// a truncated copy must be rejected rather than misread.
+void testSerialization() {
+    std::vector<CompiledExpression> expressions;
+    std::vector<std::uint64_t> expected;
+    Parser parser;
+    size_t failures = 0;
+
+    for (auto& i : evaluations) {
+        parser.setBufferView(i.buffer);
+        expressions.push_back(createCompiledExpression(parser, parser.parseExpression()));
+        expected.push_back(i.result);
+        parser.reset();
+    }
+
+    std::uint64_t values[2] = { 12345, 67890 };
+    for (auto& i : variableEvaluations) {
+        parser.setBufferView(i.buffer);
+        expressions.push_back(createCompiledExpression(parser, parser.parseExpression()));
+        expected.push_back(expressions.back().evaluate(values));
+        parser.reset();
+    }
+
+    std::vector<std::uint8_t> out;
+    writeExpressionFormatHeader(out);
+    for (auto& expression : expressions)
+        writeCompiledExpression(out, expression);
+
+    const std::uint8_t *data = out.data(), *end = out.data() + out.size();
+    CompiledExpression loaded;
+    if (!readExpressionFormatHeader(data, end))
+        failures++;
+    for (size_t i = 0; i < expressions.size(); i++)
+        if (!readCompiledExpression(data, end, loaded) || loaded.evaluate(values) != expected[i] || loaded.variables.size() != expressions[i].variables.size())
+            failures++;
+    if (data != end)
+        failures++;
+
+    printf("Test %s serialization of %zu expressions in %zu bytes :: %zu failures\n", failures ? "failed" : "passed", expressions.size(), out.size(), failures);
+
+    data = out.data();
+    end = out.data() + out.size() - 1;
+    bool rejected = false;
+    readExpressionFormatHeader(data, end);
+    while (data < end && !rejected)
+        rejected = !readCompiledExpression(data, end, loaded);
+    printf("Test %s truncated serialization is rejected\n", rejected ? "passed" : "failed");
+}
+
+// Formulas written to a store must evaluate in place, by id, to the same values
+// as the expressions they were compiled from.
+void testFormulaStore() {
+    char path[] = "/tmp/expression_store_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("Test failed formula store :: cannot create %s\n", path);
+        return;
+    }
+    close(fd);
+
+    std::vector<CompiledExpression> expressions;
+    Parser parser;
+    for (auto& i : evaluations) {
+        parser.setBufferView(i.buffer);
+        expressions.push_back(createCompiledExpression(parser, parser.parseExpression()));
+        parser.reset();
+    }
+    for (auto& i : variableEvaluations) {
+        parser.setBufferView(i.buffer);
+        expressions.push_back(createCompiledExpression(parser, parser.parseExpression()));
+        parser.reset();
+    }
+
+    FormulaStore store;
+    size_t failures = 0;
+    if (!saveFormulaStore(path, expressions) || !store.open(path) || store.size() != expressions.size())
+        failures++;
+
+    // No verify() call: each formula is verified on its first evaluate().
+    std::uint64_t values[2] = { 31337, 4242 };
+    for (size_t id = 0; id < store.size(); id++) {
+        if (store.evaluate(id, values) != expressions[id].evaluate(values) || store.getVariableCount(id) != expressions[id].variables.size())
+            failures++;
+        for (size_t slot = 0; slot < store.getVariableCount(id); slot++)
+            if (store.getVariableName(id, slot) != expressions[id].variables.getName(slot))
+                failures++;
+    }
+    if (!store.verify())
+        failures++;
+
+    // An unknown opcode in formula 0 and a huge stack depth in formula 1 are
+    // refused on use, the others still work.
+    FormulaStoreEntry entry;
+    std::uint32_t hugeDepth = 0xFFFFFFFF;
+    FILE *file = fopen(path, "r+b");
+    if (!file || fseek(file, sizeof(FormulaStoreHeader), SEEK_SET) != 0 || fread(&entry, sizeof(entry), 1, file) != 1 ||
+        fseek(file, entry.offset + entry.constantCount * sizeof(std::uint64_t), SEEK_SET) != 0 || fputc(0xFF, file) == EOF ||
+        fseek(file, sizeof(FormulaStoreHeader) + sizeof(FormulaStoreEntry) + offsetof(FormulaStoreEntry, maxStackDepth), SEEK_SET) != 0 ||
+        fwrite(&hugeDepth, sizeof(hugeDepth), 1, file) != 1)
+        failures++;
+    if (file)
+        fclose(file);
+
+    // Reopening replaces the old mapping and forgets what was verified in it.
+    if (!store.open(path) || store.evaluate(0) != 0 || store.evaluate(1) != 0 || store.evaluate(2) != expressions[2].evaluate() || store.verify())
+        failures++;
+    unlink(path);
+
+    printf("Test %s formula store of %zu formulas :: %zu failures\n", failures ? "failed" : "passed", expressions.size(), failures);
+}
+
+// Inputs far deeper than the native stack allows, through the iterative parser
+// and evaluator, every tree walk built on them and the shipped stream modes.
+void testDeepExpressions() {
+    const size_t depth = 1000000;
+    Parser parser;
+    std::string buffer;
+
+    buffer.reserve(depth * 4);
+    buffer = "1";
+    for (size_t i = 1; i < depth; i++)
+        buffer += " + 1";
+    parser.setBufferView(buffer);
+    std::uint64_t result = evaluateConstantExpressionTreeIterative(parser.parseExpressionIterative());
+    printf("Test %s chain of %zu terms :: (my result: %" PRId64 ") == (expected: %zu)\n", result == depth ? "passed" : "failed", depth, (std::int64_t) result, depth);
+    parser.reset();
+
+    buffer = "10000";
+    for (size_t i = 1; i < 10000; i++)
+        buffer += " - 1";
+    parser.setBufferView(buffer);
+    result = evaluateConstantExpressionTree(parser.parseExpression());
+    printf("Test %s chain of 10000 subtractions :: (my result: %" PRId64 ") == (expected: 1)\n", result == 1 ? "passed" : "failed", (std::int64_t) result);
+    parser.reset();
+
+    buffer.assign(depth, '(');
+    buffer += "7";
+    buffer.append(depth, ')');
+    parser.setBufferView(buffer);
+    result = evaluateConstantExpressionTreeIterative(parser.parseExpressionIterative());
+    printf("Test %s %zu nested parentheses :: (my result: %" PRId64 ") == (expected: 7)\n", result == 7 ? "passed" : "failed", depth, (std::int64_t) result);
+    parser.reset();
+
+    // x * 1 + x * 1 + ... keeps the simplifier from folding the chain away.
+    buffer = "x * 1";
+    for (size_t i = 1; i < depth; i++)
+        buffer += " + x";
+    parser.setBufferView(buffer);
+    Tree *tree = parser.parseExpressionIterative();
+    std::uint64_t x = 3;
+    ExpressionDag dag;
+    size_t failures = 0;
+    if (createCompiledExpression(parser, tree).evaluate(&x) != 3 * depth || evaluateBytecode(compileExpressionTree(tree), &x) != 3 * depth ||
+        evaluateCompactTree(createCompactTree(tree), &x) != 3 * depth || dag.evaluate(dag.intern(tree), &x) != 3 * depth)
+        failures++;
+    printf("Test %s compiling a chain of %zu terms :: %zu failures\n", failures ? "failed" : "passed", depth, failures);
+    parser.reset();
+
+    // The same deep inputs as lines of a stream, in both evaluation modes.
+    std::string lines(depth, '(');
+    lines += "7";
+    lines.append(depth, ')');
+    lines += "\n1";
+    for (size_t i = 1; i < depth; i++)
+        lines += " + 1";
+    lines += "\n";
+    std::string expected = "7\n" + std::to_string(depth) + "\n";
+    for (EvaluationMode mode : { EVALUATION_MODE_TREE, EVALUATION_MODE_DIRECT }) {
+        char *output = nullptr;
+        size_t outputSize = 0;
+        FILE *in = fmemopen(lines.data(), lines.length(), "r");
+        FILE *out = open_memstream(&output, &outputSize);
+        bool ok = in && out && evaluateExpressionStream(in, out, mode);
+        if (in)
+            fclose(in);
+        if (out)
+            fclose(out);
+        ok = ok && std::string_view(output, outputSize) == expected;
+        printf("Test %s deep expressions through the %s stream\n", ok ? "passed" : "failed", mode == EVALUATION_MODE_DIRECT ? "direct" : "tree");
+        free(output);
+    }
+}
+
+#ifdef EXPRESSION_BENCHMARK
+struct BenchmarkWorkload {
+    const char *name;
+    std::vector<std::string> expressions;
+    size_t bytes = 0;
+};
+
+static BenchmarkWorkload makeWorkload(const char *name, std::vector<std::string> expressions) {
+    BenchmarkWorkload workload;
+    workload.name = name;
+    workload.expressions = std::move(expressions);
+    for (auto& e : workload.expressions)
+        workload.bytes += e.length();
+    return workload;
+}
+
+static std::vector<BenchmarkWorkload> generateWorkloads() {
+    std::vector<BenchmarkWorkload> workloads;
+    std::vector<std::string> expressions;
+
+    for (int i = 0; i < 1024; i++)
+        expressions.push_back(std::to_string(i % 97) + " + " + std::to_string(i % 13) + " * " + std::to_string(i % 7));
+    workloads.push_back(makeWorkload("short", std::move(expressions)));
+
+    expressions.clear();
+    for (int i = 0; i < 64; i++) {
+        std::string e = std::to_string(i);
+        for (int depth = 0; depth < 200; depth++)
+            e = "(" + e + (depth % 2 ? " * " : " + ") + std::to_string(depth % 10 + 1) + ")";
+        expressions.push_back(e);
+    }
+    workloads.push_back(makeWorkload("deep_nested", std::move(expressions)));
+
+    expressions.clear();
+    for (int i = 0; i < 64; i++) {
+        std::string e = std::to_string(i);
+        for (int term = 1; term < 1000; term++)
+            e += (term % 3 ? " + " : " * ") + std::to_string(term % 100);
+        expressions.push_back(e);
+    }
+    workloads.push_back(makeWorkload("long_chain", std::move(expressions)));
+
+    expressions.clear();
+    for (int i = 0; i < 1024; i++)
+        expressions.push_back(std::to_string(1000000000000000000ull + i * 7919ull) + " * " + std::to_string(999999999999999ull - i) + " + " + std::to_string(123456789012345678ull + i));
+    workloads.push_back(makeWorkload("large_literals", std::move(expressions)));
+
+    // Many distinct formulas, each evaluated once per pass, so per-formula
+    // overheads like code placement show up rather than one hot formula.
+    expressions.clear();
+    for (int i = 0; i < 4096; i++)
+        expressions.push_back(std::to_string(i) + " * x + " + std::to_string(i % 61) + " * (y - " + std::to_string(i % 17) + ") + z * " + std::to_string(i % 29));
+    workloads.push_back(makeWorkload("distinct_formulas", std::move(expressions)));
+
+    return workloads;
+}
+
+static volatile std::uint64_t benchmarkSink;
+
+// Runs body (one pass over the workload) until at least minimumTime has elapsed
+// and prints the per-expression cost and input throughput.
+template <typename Body>
+static void runBenchmark(const char *stage, const BenchmarkWorkload& workload, Body body) {
+    using Clock = std::chrono::steady_clock;
+    const auto minimumTime = std::chrono::milliseconds(200);
+
+    body();
+
+    size_t iterations = 0;
+    auto start = Clock::now();
+    auto elapsed = Clock::duration::zero();
+    do {
+        body();
+        iterations++;
+        elapsed = Clock::now() - start;
+    } while (elapsed < minimumTime);
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    double expressions = (double) iterations * workload.expressions.size();
+    char name[64];
+    snprintf(name, sizeof(name), "%s/%s", stage, workload.name);
+    printf("%-32s %12.1f %12.1f %12zu\n", name, seconds * 1e9 / expressions, iterations * workload.bytes / seconds / 1e6, iterations);
+}
+
+static void benchmarkWorkload(const BenchmarkWorkload& workload, std::string_view filter) {
+    auto selected = [&](const char *stage) {
+        std::string name = std::string(stage) + "/" + workload.name;
+        return filter.empty() || name.find(filter) != std::string::npos;
+    };
+
+    if (selected("lex")) {
+        Scanner scanner;
+        runBenchmark("lex", workload, [&] {
+            std::uint64_t tokens = 0;
+            for (auto& e : workload.expressions) {
+                scanner.setBufferView(e);
+                while (scanner.peekToken().type != TOKEN_TYPE_NULL) {
+                    scanner.nextToken();
+                    tokens++;
+                }
+            }
+            benchmarkSink = tokens;
+        });
+    }
+
+    if (selected("parse")) {
+        Parser parser;
+        runBenchmark("parse", workload, [&] {
+            for (auto& e : workload.expressions) {
+                parser.setBufferView(e);
+                benchmarkSink = reinterpret_cast<uintptr_t>(parser.parseExpression());
+                parser.reset();
+            }
+        });
+    }
+
+    // One parser and no reset, so every tree lands back to back in one arena.
+    Parser treeParser;
+    std::vector<Tree *> trees;
+    for (auto& e : workload.expressions) {
+        treeParser.setBufferView(e);
+        trees.push_back(treeParser.parseExpression());
+    }
+
+    if (selected("evaluate")) {
+        runBenchmark("evaluate", workload, [&] {
+            for (Tree *tree : trees)
+                benchmarkSink = evaluateConstantExpressionTree(tree);
+        });
+    }
+
+    if (selected("bytecode")) {
+        std::vector<Bytecode> programs;
+        for (Tree *tree : trees)
+            programs.push_back(compileExpressionTree(tree));
+        runBenchmark("bytecode", workload, [&] {
+            for (auto& program : programs)
+                benchmarkSink = evaluateBytecode(program);
+        });
+    }
+
+    if (selected("compact")) {
+        std::vector<CompactTree> compactTrees;
+        std::vector<std::uint64_t> values;
+        for (Tree *tree : trees)
+            compactTrees.push_back(createCompactTree(tree));
+        runBenchmark("compact", workload, [&] {
+            for (auto& compact : compactTrees)
+                benchmarkSink = evaluateCompactTree(compact, nullptr, values);
+        });
+    }
+
+    if (selected("jit")) {
+        JitCodeArena codeArena;
+        std::vector<JitExpression> programs(trees.size());
+        for (size_t i = 0; i < trees.size(); i++)
+            programs[i].compile(trees[i], codeArena);
+        codeArena.seal();
+        runBenchmark("jit", workload, [&] {
+            for (auto& program : programs)
+                benchmarkSink = program.evaluate();
+        });
+    }
+
+    if (selected("end_to_end")) {
+        Parser parser;
+        runBenchmark("end_to_end", workload, [&] {
+            for (auto& e : workload.expressions) {
+                parser.setBufferView(e);
+                benchmarkSink = evaluateConstantExpressionTree(parser.parseExpression());
+                parser.reset();
+            }
+        });
+    }
+
+    if (selected("direct")) {
+        Parser parser;
+        runBenchmark("direct", workload, [&] {
+            for (auto& e : workload.expressions) {
+                parser.setBufferView(e);
+                benchmarkSink = parser.evaluateExpression();
+            }
+        });
+    }
+
+    if (selected("cached")) {
+        ExpressionCache cache(workload.expressions.size());
+        runBenchmark("cached", workload, [&] {
+            for (auto& e : workload.expressions)
+                benchmarkSink = cache.evaluate(e);
+        });
+    }
+}
+
+// expression_benchmark [filter] runs every stage/workload pair whose name
+// contains filter.
+int main(int argc, char *argv[]) {
+    std::string_view filter = argc > 1 ? argv[1] : "";
+
+    printf("%-32s %12s %12s %12s\n", "Benchmark", "ns/expr", "MB/s", "Iterations");
+    for (auto& workload : generateWorkloads())
+        benchmarkWorkload(workload, filter);
+    return 0;
+}
+#else
+static void printUsage(const char *program) {
+    printf("usage: %s                           run the built-in tests\n", program);
+    printf("       %s [--direct] --stream [file]  evaluate one expression per line of file (stdin when omitted or -)\n", program);
+    printf("       %s [--direct] --mmap file      like --stream, but map the file instead of reading it\n", program);
+    printf("--direct evaluates while parsing instead of building a tree\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 1) {
+        testExpressions();
+        testVariableExpressions();
+        testExpressionTemplates();
+        testExpressionCache();
+        testConcurrentExpressionCache();
+        testExpressionDag();
+        testDirectEvaluation();
+        testCharacterRunCounters();
+        testSerialization();
+        testFormulaStore();
+        testBatchEvaluation();
+        testDeepExpressions();
+        return 0;
+    }
+
+    const char *program = argv[0];
+    EvaluationMode evaluationMode = EVALUATION_MODE_TREE;
+    if (std::string_view(argv[1]) == "--direct") {
+        evaluationMode = EVALUATION_MODE_DIRECT;
+        argc--;
+        argv++;
+    }
+
+    std::string_view mode = argc > 1 ? argv[1] : "";
+    if (mode == "--stream" && argc <= 3) {
+        FILE *input = stdin;
+        if (argc == 3 && std::string_view(argv[2]) != "-") {
+            input = fopen(argv[2], "rb");
+            if (!input) {
+                fprintf(stderr, "Cannot open %s\n", argv[2]);
+                return 1;
+            }
+        }
+
+        bool ok = evaluateExpressionStream(input, stdout, evaluationMode);
+        if (input != stdin)
+            fclose(input);
+        return ok ? 0 : 1;
+    }
+
+    if (mode == "--mmap" && argc == 3)
+        return evaluateMappedFile(argv[2], stdout, evaluationMode) ? 0 : 1;
+
+    printUsage(program);
+    return 1;
+}
+#endif